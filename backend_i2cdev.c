@@ -0,0 +1,204 @@
+/* Linux i2c-dev backend: talks to /dev/i2c-N directly with no pigpiod in the way
+ *
+ * Where the adapter can do plain i2c we use combined I2C_RDWR transfers, so a
+ * register read is one ioctl and a batch of block writes - a whole frame of servo
+ * updates, even across several chips - is one ioctl ending in a single STOP.
+ * Adapters that only speak SMBus (such as the kernel's i2c-stub, handy for testing)
+ * fall back to I2C_SMBUS calls limited to 32 byte blocks.
+ *
+ * Options, after "i2c-dev:"
+ *   path=FILE   use FILE rather than /dev/i2c-<bus>
+ *   smbus       use SMBus transfers even if plain i2c is available
+ *
+ * Released under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "pca9685_backend.h"
+
+#define I2CDEV_MAX_BLOCK 255   // more than the PCA9685's whole register file needs
+
+struct i2cdev_priv {
+    int fd;
+    int useSmbus;       // adapter can't do I2C_RDWR
+    int slaveAddr;      // address last set with I2C_SLAVE, for the SMBus path
+    uint8_t buf[I2C_RDWR_IOCTL_MAX_MSGS][I2CDEV_MAX_BLOCK + 1];
+};
+
+static int i2cdev_open(struct pca_backend *be, int bus, const char *options)
+{
+    struct i2cdev_priv *priv;
+    char path[64];
+    unsigned long funcs;
+    int forceSmbus = 0;
+
+    snprintf(path, sizeof(path), "/dev/i2c-%d", bus);
+    if (options) {
+        if (!strncmp(options, "path=", 5)) {
+            snprintf(path, sizeof(path), "%s", options + 5);
+        } else if (!strcmp(options, "smbus")) {
+            forceSmbus = 1;
+        } else {
+            fprintf(stderr, "Unknown i2c-dev backend option '%s'\n", options);
+            return -EINVAL;
+        }
+    }
+    priv = calloc(1, sizeof(*priv));
+    if (!priv) return -ENOMEM;
+    if ((priv->fd = open(path, O_RDWR)) < 0) {
+        fprintf(stderr, "Unable to open %s: %m; is the i2c-dev module loaded?\n", path);
+        free(priv);
+        return -ENODEV;
+    }
+    if (ioctl(priv->fd, I2C_FUNCS, &funcs) < 0) funcs = 0;
+    if ((funcs & I2C_FUNC_I2C) && !forceSmbus) {
+        be->maxBlock = I2CDEV_MAX_BLOCK;
+    } else if (funcs & I2C_FUNC_SMBUS_I2C_BLOCK) {
+        priv->useSmbus = 1;
+        be->maxBlock = I2C_SMBUS_BLOCK_MAX;
+    } else {
+        fprintf(stderr, "%s supports neither i2c transfers nor SMBus block transfers\n", path);
+        close(priv->fd);
+        free(priv);
+        return -EOPNOTSUPP;
+    }
+    priv->slaveAddr = -1;
+    // SMBus sends each write on its own, with its own STOP
+    be->maxMulti = priv->useSmbus ? 1 : I2C_RDWR_IOCTL_MAX_MSGS;
+    be->priv = priv;
+    return 0;
+}
+
+static void i2cdev_close(struct pca_backend *be)
+{
+    struct i2cdev_priv *priv = be->priv;
+    close(priv->fd);
+    free(priv);
+    be->priv = NULL;
+}
+
+static int i2cdev_attach(struct pca_backend *be, int addr)
+{
+    return (addr < 0 || addr > 127) ? -EINVAL : 0;
+}
+
+static int smbus_access(struct i2cdev_priv *priv, int addr, char readWrite, int reg,
+                        int size, union i2c_smbus_data *data)
+{
+    struct i2c_smbus_ioctl_data args;
+
+    if (addr != priv->slaveAddr) {
+        if (ioctl(priv->fd, I2C_SLAVE, addr) < 0) return -errno;
+        priv->slaveAddr = addr;
+    }
+    args.read_write = readWrite;
+    args.command = reg;
+    args.size = size;
+    args.data = data;
+    return ioctl(priv->fd, I2C_SMBUS, &args) < 0 ? -errno : 0;
+}
+
+static int i2cdev_read_block(struct pca_backend *be, int addr, int reg, uint8_t *buf, int count)
+{
+    struct i2cdev_priv *priv = be->priv;
+    struct i2c_rdwr_ioctl_data rdwr;
+    struct i2c_msg msgs[2];
+    uint8_t regByte = reg;
+    int ret;
+
+    if (priv->useSmbus) {
+        union i2c_smbus_data data;
+        data.block[0] = count;
+        ret = smbus_access(priv, addr, I2C_SMBUS_READ, reg, I2C_SMBUS_I2C_BLOCK_DATA, &data);
+        if (ret < 0) return ret;
+        memcpy(buf, &data.block[1], count);
+        return count;
+    }
+    // write the register number then read back with a repeated start
+    msgs[0].addr = addr;
+    msgs[0].flags = 0;
+    msgs[0].len = 1;
+    msgs[0].buf = &regByte;
+    msgs[1].addr = addr;
+    msgs[1].flags = I2C_M_RD;
+    msgs[1].len = count;
+    msgs[1].buf = buf;
+    rdwr.msgs = msgs;
+    rdwr.nmsgs = 2;
+    return ioctl(priv->fd, I2C_RDWR, &rdwr) < 0 ? -errno : count;
+}
+
+static int i2cdev_write_multi(struct pca_backend *be, const struct pca_xfer *xfers, int count)
+{
+    struct i2cdev_priv *priv = be->priv;
+    struct i2c_rdwr_ioctl_data rdwr;
+    struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+    int i, ret;
+
+    if (priv->useSmbus) {
+        for (i = 0; i < count; i++) {
+            union i2c_smbus_data data;
+            data.block[0] = xfers[i].count;
+            memcpy(&data.block[1], xfers[i].buf, xfers[i].count);
+            ret = smbus_access(priv, xfers[i].addr, I2C_SMBUS_WRITE, xfers[i].reg,
+                               I2C_SMBUS_I2C_BLOCK_DATA, &data);
+            if (ret < 0) return ret;
+        }
+        return count;
+    }
+    if (count > I2C_RDWR_IOCTL_MAX_MSGS) return -EINVAL;
+    // each message is the register number followed by its data, and the adapter
+    // sends them all with repeated starts and a single STOP at the end
+    for (i = 0; i < count; i++) {
+        priv->buf[i][0] = xfers[i].reg;
+        memcpy(&priv->buf[i][1], xfers[i].buf, xfers[i].count);
+        msgs[i].addr = xfers[i].addr;
+        msgs[i].flags = 0;
+        msgs[i].len = xfers[i].count + 1;
+        msgs[i].buf = priv->buf[i];
+    }
+    rdwr.msgs = msgs;
+    rdwr.nmsgs = count;
+    return ioctl(priv->fd, I2C_RDWR, &rdwr) < 0 ? -errno : count;
+}
+
+static int i2cdev_write_block(struct pca_backend *be, int addr, int reg, const uint8_t *buf, int count)
+{
+    struct pca_xfer xfer = { addr, reg, buf, count };
+    int ret = i2cdev_write_multi(be, &xfer, 1);
+    return ret < 0 ? ret : count;
+}
+
+static int i2cdev_read_byte(struct pca_backend *be, int addr, int reg)
+{
+    uint8_t value;
+    int ret = i2cdev_read_block(be, addr, reg, &value, 1);
+    return ret < 0 ? ret : value;
+}
+
+static int i2cdev_write_byte(struct pca_backend *be, int addr, int reg, uint8_t value)
+{
+    int ret = i2cdev_write_block(be, addr, reg, &value, 1);
+    return ret < 0 ? ret : 0;
+}
+
+const struct pca_backend_ops pca_i2cdev_backend = {
+    .name = "i2c-dev",
+    .open = i2cdev_open,
+    .close = i2cdev_close,
+    .attach = i2cdev_attach,
+    .read_byte = i2cdev_read_byte,
+    .write_byte = i2cdev_write_byte,
+    .read_block = i2cdev_read_block,
+    .write_block = i2cdev_write_block,
+    .write_multi = i2cdev_write_multi,
+};
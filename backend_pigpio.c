@@ -0,0 +1,127 @@
+/* pigpiod_if2 backend: every access is a round trip over the socket to pigpiod
+ *
+ * It takes no options. The bus is whichever i2c bus pigpiod will open, 0 or 1
+ * on older pigpiod releases.
+ *
+ * Released under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <pigpiod_if2.h>
+
+#include "pca9685_backend.h"
+
+#define PIGPIO_MAX_BLOCK 32 // pigpiod, like SMBus, limits an i2c block transfer to 32 bytes
+
+struct pigpio_priv {
+    int pi;             // the pigpiod connection
+    int handle[128];    // i2c handle for each 7-bit address, -1 until attached
+};
+
+static int pigpio_open(struct pca_backend *be, int bus, const char *options)
+{
+    struct pigpio_priv *priv;
+    int addr, h;
+
+    if (options) {
+        fprintf(stderr, "Unknown pigpio backend option '%s'\n", options);
+        return -EINVAL;
+    }
+    priv = calloc(1, sizeof(*priv));
+    if (!priv) return -ENOMEM;
+    // connect to the daemon, quit if that fails
+    priv->pi = pigpio_start(NULL, NULL);
+    if (priv->pi < 0) {
+        fprintf(stderr, "Unable to connect to pigpiod; is it running?\n");
+        free(priv);
+        return -ENODEV;
+    }
+    // handles are opened lazily, so try the bus now rather than at the first board;
+    // opening one doesn't put anything on the wire
+    h = i2c_open(priv->pi, bus, 0, 0);
+    if (h < 0) {
+        fprintf(stderr, "pigpiod can't open i2c bus %d: %s\n", bus, pigpio_error(h));
+        pigpio_stop(priv->pi);
+        free(priv);
+        return -ENODEV;
+    }
+    i2c_close(priv->pi, h);
+    for (addr = 0; addr < 128; addr++) priv->handle[addr] = -1;
+    be->priv = priv;
+    be->maxBlock = PIGPIO_MAX_BLOCK;
+    return 0;
+}
+
+static void pigpio_close(struct pca_backend *be)
+{
+    struct pigpio_priv *priv = be->priv;
+    int addr;
+
+    /* disconnect from pigpiod and release the handles */
+    for (addr = 0; addr < 128; addr++) {
+        if (priv->handle[addr] >= 0) i2c_close(priv->pi, priv->handle[addr]);
+    }
+    pigpio_stop(priv->pi);
+    free(priv);
+    be->priv = NULL;
+}
+
+static int pigpio_attach(struct pca_backend *be, int addr)
+{
+    struct pigpio_priv *priv = be->priv;
+
+    if (addr < 0 || addr > 127) return -EINVAL;
+    if (priv->handle[addr] < 0) {
+        priv->handle[addr] = i2c_open(priv->pi, be->bus, addr, 0);
+    }
+    return priv->handle[addr];
+}
+
+// pigpiod wants a handle per address, so open one the first time an address is used
+static int pigpio_handle(struct pca_backend *be, int addr)
+{
+    struct pigpio_priv *priv = be->priv;
+    return priv->handle[addr] >= 0 ? priv->handle[addr] : pigpio_attach(be, addr);
+}
+
+static int pigpio_read_byte(struct pca_backend *be, int addr, int reg)
+{
+    struct pigpio_priv *priv = be->priv;
+    int h = pigpio_handle(be, addr);
+    return h < 0 ? h : i2c_read_byte_data(priv->pi, h, reg);
+}
+
+static int pigpio_write_byte(struct pca_backend *be, int addr, int reg, uint8_t value)
+{
+    struct pigpio_priv *priv = be->priv;
+    int h = pigpio_handle(be, addr);
+    return h < 0 ? h : i2c_write_byte_data(priv->pi, h, reg, value);
+}
+
+static int pigpio_read_block(struct pca_backend *be, int addr, int reg, uint8_t *buf, int count)
+{
+    struct pigpio_priv *priv = be->priv;
+    int h = pigpio_handle(be, addr);
+    return h < 0 ? h : i2c_read_i2c_block_data(priv->pi, h, reg, (char *)buf, count);
+}
+
+static int pigpio_write_block(struct pca_backend *be, int addr, int reg, const uint8_t *buf, int count)
+{
+    struct pigpio_priv *priv = be->priv;
+    int h = pigpio_handle(be, addr);
+    return h < 0 ? h : i2c_write_i2c_block_data(priv->pi, h, reg, (char *)buf, count);
+}
+
+const struct pca_backend_ops pca_pigpio_backend = {
+    .name = "pigpio",
+    .open = pigpio_open,
+    .close = pigpio_close,
+    .attach = pigpio_attach,
+    .read_byte = pigpio_read_byte,
+    .write_byte = pigpio_write_byte,
+    .read_block = pigpio_read_block,
+    .write_block = pigpio_write_block,
+};
@@ -0,0 +1,309 @@
+/* Simulated PCA9685 backend
+ *
+ * Models the register file of any number of chips on one bus, including the MODE1
+ * AI/SLEEP/RESTART behaviour, PRE_SCALE only being writable while asleep, the
+ * ALL_LED registers and the ALLCALL/SUBADRn broadcast addresses. Every transaction
+ * is charged a simulated bus time so throughput can be measured without a Pi.
+ *
+ * Options, separated by commas after "sim:"
+ *   latency=N   fixed per-transaction overhead in microseconds (default 0)
+ *   clock=N     i2c bus clock in kHz (default 100)
+ *   sleep       really sleep for each transaction's simulated duration
+ *   keep=FILE   keep the chips' registers in FILE, so like real hardware they
+ *               outlive the daemon and a restarted one finds them as they were
+ *
+ * Released under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "pca9685.h"
+#include "pca9685_backend.h"
+
+#define SIM_MAX_CHIPS 62        // the most PCA9685s one bus can address
+#define SIM_MAX_BLOCK 256
+#define OSC_STABLE_NSEC 500000  // datasheet: wait 500us after waking before RESTART
+
+struct sim_chip {
+    int addr;
+    uint8_t regs[256];
+    int running;                // oscillator on and outputs active
+    struct timespec wokeAt;     // when SLEEP was last cleared
+};
+
+// the chips on the bus; mapped from the keep= file if there is one
+struct sim_bus_state {
+    struct sim_chip chips[SIM_MAX_CHIPS];
+    int numChips;
+};
+
+struct sim_priv {
+    struct sim_bus_state *state;
+    int kept;                   // state is mapped from a file
+    double latencyUSec;
+    double clockKHz;
+    int sleep;
+    double busTimeUSec;         // total simulated time the bus has been busy
+    unsigned long warnings;     // things a real chip would not have liked
+};
+
+static void sim_reset_chip(struct sim_chip *chip, int addr)
+{
+    int ch;
+    // power on defaults, see PCA9685.pdf 7.3
+    memset(chip, 0, sizeof(*chip));
+    chip->addr = addr;
+    chip->regs[MODE1] = SLEEP | ALLCALL;
+    chip->regs[MODE2] = OUTDRV;
+    chip->regs[SUBADR1] = 0xE2;
+    chip->regs[SUBADR2] = 0xE4;
+    chip->regs[SUBADR3] = 0xE8;
+    chip->regs[ALLCALLADR] = 0xE0;
+    for (ch = 0; ch < 16; ch++) {
+        chip->regs[LED0_OFF_H + LED_MULTIPLYER * ch] = LED_FULL;
+    }
+    chip->regs[PRE_SCALE] = 0x1E;
+}
+
+static int sim_responds(struct sim_chip *chip, int addr)
+{
+    uint8_t mode1 = chip->regs[MODE1];
+    return addr == chip->addr
+        || ((mode1 & ALLCALL) && addr == chip->regs[ALLCALLADR] >> 1)
+        || ((mode1 & SUB1) && addr == chip->regs[SUBADR1] >> 1)
+        || ((mode1 & SUB2) && addr == chip->regs[SUBADR2] >> 1)
+        || ((mode1 & SUB3) && addr == chip->regs[SUBADR3] >> 1);
+}
+
+// with AI set the control register steps on after each byte, wrapping from the
+// last LED register (or from the end of the register file) back to MODE1
+static int sim_next_reg(struct sim_chip *chip, int reg)
+{
+    if (!(chip->regs[MODE1] & AI)) return reg;
+    return (reg == LED15_OFF_H || reg == TESTMODE) ? MODE1 : reg + 1;
+}
+
+static void sim_write_reg(struct sim_priv *priv, struct sim_chip *chip, int reg, uint8_t value)
+{
+    struct timespec now;
+    int ch;
+
+    if (reg == MODE1) {
+        uint8_t old = chip->regs[MODE1];
+        // writing a 1 to RESTART clears it, writing a 0 leaves it alone
+        uint8_t restart = (value & RESTART) ? 0 : (old & RESTART);
+        if ((value & RESTART) && (old & RESTART)) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - chip->wokeAt.tv_sec) * 1000000000L
+                    + (now.tv_nsec - chip->wokeAt.tv_nsec) < OSC_STABLE_NSEC) {
+                priv->warnings++;
+            }
+        }
+        if ((value & SLEEP) && !(old & SLEEP)) {
+            // going to sleep with the outputs running sets RESTART
+            if (chip->running) restart = RESTART;
+            chip->running = 0;
+        } else if (!(value & SLEEP) && (old & SLEEP)) {
+            clock_gettime(CLOCK_MONOTONIC, &chip->wokeAt);
+            chip->running = 1;
+        }
+        chip->regs[MODE1] = (value & ~RESTART) | restart;
+    } else if (reg == PRE_SCALE) {
+        // the prescaler can only be changed while the oscillator is asleep
+        if (!(chip->regs[MODE1] & SLEEP)) {
+            priv->warnings++;
+            return;
+        }
+        chip->regs[PRE_SCALE] = value < 3 ? 3 : value;
+    } else if (reg >= ALLLED_ON_L && reg <= ALLLED_OFF_H) {
+        for (ch = 0; ch < 16; ch++) {
+            chip->regs[LED0_ON_L + LED_MULTIPLYER * ch + (reg - ALLLED_ON_L)] = value;
+        }
+    } else if (reg <= LED15_OFF_H) {
+        chip->regs[reg] = value;
+    }
+    // everything else is reserved and ignores writes
+}
+
+static uint8_t sim_read_reg(struct sim_chip *chip, int reg)
+{
+    if (reg <= LED15_OFF_H || reg == PRE_SCALE) return chip->regs[reg];
+    return 0; // ALL_LED and reserved registers read back as zero
+}
+
+// charge a transaction of count data bytes to the bus: start, address and register
+// bytes, a repeated start and address again for reads, then the data and a stop
+static void sim_charge(struct pca_backend *be, int count, int isRead)
+{
+    struct sim_priv *priv = be->priv;
+    int bits = 9 * (2 + (isRead ? 1 : 0) + count) + 2;
+    double usec = bits * 1000.0 / priv->clockKHz + priv->latencyUSec;
+
+    priv->busTimeUSec += usec;
+    if (priv->sleep) usleep((useconds_t)usec);
+}
+
+// map the chips from a file, one per bus, so they survive the daemon stopping
+static int sim_keep(struct sim_priv *priv, const char *path, int bus)
+{
+    char name[4096];
+    int fd;
+
+    snprintf(name, sizeof(name), "%s.%d", path, bus);
+    if ((fd = open(name, O_RDWR | O_CREAT, 0644)) < 0) return -1;
+    if (ftruncate(fd, sizeof(*priv->state)) < 0) {
+        close(fd);
+        return -1;
+    }
+    priv->state = mmap(NULL, sizeof(*priv->state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (priv->state == MAP_FAILED) {
+        priv->state = NULL;
+        return -1;
+    }
+    if (priv->state->numChips < 0 || priv->state->numChips > SIM_MAX_CHIPS) priv->state->numChips = 0;
+    priv->kept = 1;
+    return 0;
+}
+
+static int sim_open(struct pca_backend *be, int bus, const char *options)
+{
+    struct sim_priv *priv;
+    char *opts, *opt, *save;
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv) return -ENOMEM;
+    priv->clockKHz = 100;
+    if (options) {
+        opts = strdup(options);
+        for (opt = strtok_r(opts, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+            if (!strncmp(opt, "latency=", 8)) {
+                priv->latencyUSec = atof(opt + 8);
+            } else if (!strncmp(opt, "clock=", 6)) {
+                priv->clockKHz = atof(opt + 6);
+            } else if (!strcmp(opt, "sleep")) {
+                priv->sleep = 1;
+            } else if (!strncmp(opt, "keep=", 5)) {
+                if (sim_keep(priv, opt + 5, bus) < 0) {
+                    fprintf(stderr, "Can't keep the sim chips in %s: %s\n", opt + 5, strerror(errno));
+                    free(opts);
+                    free(priv);
+                    return -EINVAL;
+                }
+            } else {
+                fprintf(stderr, "Unknown sim backend option '%s'\n", opt);
+                free(opts);
+                free(priv);
+                return -EINVAL;
+            }
+        }
+        free(opts);
+        if (priv->clockKHz <= 0 || priv->latencyUSec < 0) {
+            fprintf(stderr, "Invalid sim backend timing\n");
+            free(priv);
+            return -EINVAL;
+        }
+    }
+    if (!priv->state && (priv->state = calloc(1, sizeof(*priv->state))) == NULL) {
+        free(priv);
+        return -ENOMEM;
+    }
+    be->priv = priv;
+    be->maxBlock = SIM_MAX_BLOCK;
+    return 0;
+}
+
+static void sim_close(struct pca_backend *be)
+{
+    struct sim_priv *priv = be->priv;
+
+    fprintf(stderr, "sim bus %d: %lu transactions, %lu bytes, %.0fus of bus time, %lu warnings\n",
+        be->bus, be->transactions, be->bytes, priv->busTimeUSec, priv->warnings);
+    if (priv->kept) {
+        munmap(priv->state, sizeof(*priv->state));
+    } else {
+        free(priv->state);
+    }
+    free(priv);
+    be->priv = NULL;
+}
+
+static int sim_attach(struct pca_backend *be, int addr)
+{
+    struct sim_priv *priv = be->priv;
+    int i;
+
+    for (i = 0; i < priv->state->numChips; i++) {
+        if (priv->state->chips[i].addr == addr) return 0;
+    }
+    if (priv->state->numChips == SIM_MAX_CHIPS) return -ENOSPC;
+    sim_reset_chip(&priv->state->chips[priv->state->numChips++], addr);
+    return 0;
+}
+
+static int sim_write_block(struct pca_backend *be, int addr, int reg, const uint8_t *buf, int count)
+{
+    struct sim_priv *priv = be->priv;
+    int i, n, r, acked = 0;
+
+    sim_charge(be, count, 0);
+    for (i = 0; i < priv->state->numChips; i++) {
+        struct sim_chip *chip = &priv->state->chips[i];
+        if (!sim_responds(chip, addr)) continue;
+        for (n = 0, r = reg; n < count; n++) {
+            sim_write_reg(priv, chip, r, buf[n]);
+            r = sim_next_reg(chip, r);
+        }
+        acked = 1;
+    }
+    return acked ? count : -EIO;
+}
+
+static int sim_read_block(struct pca_backend *be, int addr, int reg, uint8_t *buf, int count)
+{
+    struct sim_priv *priv = be->priv;
+    int i, n, r;
+
+    sim_charge(be, count, 1);
+    for (i = 0; i < priv->state->numChips; i++) {
+        struct sim_chip *chip = &priv->state->chips[i];
+        if (chip->addr != addr) continue;
+        for (n = 0, r = reg; n < count; n++) {
+            buf[n] = sim_read_reg(chip, r);
+            r = sim_next_reg(chip, r);
+        }
+        return count;
+    }
+    return -EIO;
+}
+
+static int sim_write_byte(struct pca_backend *be, int addr, int reg, uint8_t value)
+{
+    int ret = sim_write_block(be, addr, reg, &value, 1);
+    return ret < 0 ? ret : 0;
+}
+
+static int sim_read_byte(struct pca_backend *be, int addr, int reg)
+{
+    uint8_t value;
+    int ret = sim_read_block(be, addr, reg, &value, 1);
+    return ret < 0 ? ret : value;
+}
+
+const struct pca_backend_ops pca_sim_backend = {
+    .name = "sim",
+    .open = sim_open,
+    .close = sim_close,
+    .attach = sim_attach,
+    .read_byte = sim_read_byte,
+    .write_byte = sim_write_byte,
+    .read_block = sim_read_block,
+    .write_block = sim_write_block,
+};
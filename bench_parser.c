@@ -0,0 +1,110 @@
+/* Parser microbenchmark for the PCA9685 servo daemon
+ *
+ * Builds a synthetic corpus of command lines like the ones clients send (single
+ * and multiple assignments, relative widths, groups, timed moves) and times how
+ * many lines a second pca_parse_next() gets through. Run it with 'make
+ * bench-parser', optionally as ./bench_parser [LINES] [PASSES].
+ *
+ * Released under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "pca9685_parse.h"
+
+static uint32_t rng = 12345;
+
+static uint32_t next_random(void)
+{
+    rng = rng * 1103515245 + 12345;
+    return rng >> 8;
+}
+
+// append one assignment to the line
+static int make_assignment(char *p, size_t room)
+{
+    static const char *groups[] = { "legs", "arms", "head", "front_left" };
+    static const char *signs[] = { "", "", "", "+", "-" };
+    char target[16];
+    int n;
+
+    switch (next_random() % 8) {
+    case 0:  snprintf(target, sizeof(target), "*"); break;
+    case 1:  snprintf(target, sizeof(target), "%s", groups[next_random() % 4]); break;
+    default: snprintf(target, sizeof(target), "%u", next_random() % 64); break;
+    }
+    switch (next_random() % 4) {
+    case 0:
+        n = snprintf(p, room, "%s=%s%u", target, signs[next_random() % 5], next_random() % 500);
+        break;
+    case 1:
+        n = snprintf(p, room, "%s=%s%u.%uus", target, signs[next_random() % 5],
+            500 + next_random() % 2000, next_random() % 10);
+        break;
+    default:
+        n = snprintf(p, room, "%s=%s%u.%02u%%", target, signs[next_random() % 5],
+            next_random() % 100, next_random() % 100);
+        break;
+    }
+    if (next_random() % 4 == 0 && (size_t)n < room) {
+        static const char *moves[] = { "@250", "@750ms", "@1.5s", "@500ms:inout", "@2s:in" };
+        n += snprintf(p + n, room - n, "%s", moves[next_random() % 5]);
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    int numLines = argc > 1 ? atoi(argv[1]) : 200000;
+    int passes = argc > 2 ? atoi(argv[2]) : 20;
+    size_t size = (size_t)numLines * 128, used = 0;
+    char *corpus = malloc(size);
+    int i, j, count, status;
+    unsigned long assignments = 0, errors = 0;
+    struct pca_parser ps;
+    struct pca_assignment a;
+    struct timespec start, end;
+    const char *line, *nl;
+    double secs;
+
+    if (!corpus || numLines <= 0 || passes <= 0) {
+        fprintf(stderr, "usage: bench_parser [LINES] [PASSES]\n");
+        return 1;
+    }
+    // mostly single assignments, as most clients send, with some whole poses
+    for (i = 0; i < numLines; i++) {
+        count = next_random() % 8 == 0 ? 2 + next_random() % 6 : 1;
+        for (j = 0; j < count; j++) {
+            if (j) corpus[used++] = ',';
+            used += make_assignment(corpus + used, size - used);
+        }
+        corpus[used++] = '\n';
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < passes; i++) {
+        for (line = corpus; line < corpus + used; line = nl + 1) {
+            nl = memchr(line, '\n', corpus + used - line);
+            pca_parse_init(&ps, line, nl - line);
+            while ((status = pca_parse_next(&ps, &a)) == PCA_PARSE_OK) assignments++;
+            if (status != PCA_PARSE_DONE) errors++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%d lines (%.1f MB), %d passes: %.3f s\n", numLines, used / 1e6, passes, secs);
+    printf("%.0f lines/s, %.0f assignments/s, %.1f MB/s, %.1f ns/line\n",
+        (double)numLines * passes / secs, assignments / secs,
+        used * (double)passes / secs / 1e6, secs * 1e9 / ((double)numLines * passes));
+    if (errors) {
+        printf("%lu lines failed to parse\n", errors);
+        return 1;
+    }
+    free(corpus);
+    return 0;
+}
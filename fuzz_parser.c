@@ -0,0 +1,138 @@
+/* Fuzz target for the PCA9685 servo daemon's command parser
+ *
+ * Built with clang and -fsanitize=fuzzer -DPCA_LIBFUZZER this is a libFuzzer
+ * target. Otherwise it has its own main(): given files it parses each of them, and
+ * with none it runs a simple mutation loop over a few seed commands, so 'make
+ * fuzz-parser' does something useful with plain gcc and the sanitizers.
+ *
+ * Besides not crashing or reading past the input, the parser must always make
+ * progress and only return fields that make sense.
+ *
+ * Released under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "pca9685_parse.h"
+
+#define CHECK(cond) do { if (!(cond)) { \
+        fprintf(stderr, "fuzz_parser: %s failed at line %d\n", #cond, __LINE__); abort(); } } while (0)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    // an exact sized copy, so the sanitizer sees any read past the end
+    char *line = malloc(size ? size : 1);
+    struct pca_parser ps;
+    struct pca_assignment a;
+    const char *before;
+    int status;
+
+    CHECK(line != NULL);
+    memcpy(line, data, size);
+    pca_parse_init(&ps, line, size);
+    for (;;) {
+        before = ps.pos;
+        status = pca_parse_next(&ps, &a);
+        CHECK(ps.pos >= line && ps.pos <= line + size);
+        if (status != PCA_PARSE_OK) {
+            CHECK(status == PCA_PARSE_DONE || status == PCA_PARSE_SYNTAX
+                || status == PCA_PARSE_WIDTH || status == PCA_PARSE_DURATION);
+            CHECK(status != PCA_PARSE_DONE || ps.pos == line + size);
+            break;
+        }
+        CHECK(ps.pos > before);
+        CHECK(a.target <= PCA_TARGET_GROUP && a.unit <= PCA_UNIT_PERCENT);
+        CHECK(a.sign >= -1 && a.sign <= 1 && a.curve < PCA_NUM_CURVES);
+        CHECK(a.value >= 0);
+        if (a.target == PCA_TARGET_GROUP) {
+            CHECK(a.name >= before && a.nameLen > 0 && a.name + a.nameLen <= ps.pos);
+        }
+    }
+    free(line);
+    return 0;
+}
+
+#ifndef PCA_LIBFUZZER
+
+static uint32_t rng = 1;
+
+static uint32_t next_random(void)
+{
+    rng = rng * 1103515245 + 12345;
+    return rng >> 8;
+}
+
+static int run_file(const char *path)
+{
+    static uint8_t buf[1 << 16];
+    FILE *f = fopen(path, "rb");
+    size_t n;
+
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    LLVMFuzzerTestOneInput(buf, n);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *seeds[] = {
+        "0=50%", "3=1200us,7=+10", "legs=80%@750ms:inout", "*=-2.5%@1.5s:in",
+        "  12 = 100 , 4=0.000001%\r\n", "x_1=+999999999us@999999999s", "0=1,,2=3,",
+    };
+    static const char alphabet[] = "0123456789.,=+-*@:%usmaxinotl_ \t\r\n";
+    uint8_t buf[256];
+    long iterations = 2000000, i;
+    size_t len;
+    int j, edits, ret = 0;
+
+    if (argc > 1 && strncmp(argv[1], "-runs=", 6)) {
+        for (j = 1; j < argc; j++) ret |= run_file(argv[j]);
+        return ret;
+    }
+    if (argc > 1) iterations = atol(argv[1] + 6);
+
+    for (i = 0; i < iterations; i++) {
+        const char *seed = seeds[next_random() % (sizeof(seeds) / sizeof(seeds[0]))];
+        len = strlen(seed);
+        memcpy(buf, seed, len);
+        for (edits = 1 + next_random() % 4; edits > 0; edits--) {
+            size_t at = len ? next_random() % len : 0;
+            uint8_t c = next_random() % 4 ? alphabet[next_random() % (sizeof(alphabet) - 1)]
+                : (uint8_t)next_random();
+            switch (next_random() % 4) {
+            case 0:             // replace a byte
+                if (len) buf[at] = c;
+                break;
+            case 1:             // insert one
+                if (len < sizeof(buf)) {
+                    memmove(buf + at + 1, buf + at, len - at);
+                    buf[at] = c;
+                    len++;
+                }
+                break;
+            case 2:             // delete one
+                if (len) {
+                    memmove(buf + at, buf + at + 1, len - at - 1);
+                    len--;
+                }
+                break;
+            default:            // cut the line short
+                len = at;
+                break;
+            }
+        }
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    printf("fuzz_parser: %ld inputs, no problems found\n", iterations);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,52 @@
+/* PCA9685 register & mode definitions
+ * shared by the servo daemon and its i2c backends
+ *
+ * Released under the MIT license
+ */
+
+#ifndef PCA9685_H
+#define PCA9685_H
+
+#define DEFAULT_PCA_ADDR 0x40	
+
+// PCA9685 Register & Mode Definitions
+
+#define MODE1 0x00			//Mode  register  1
+#define MODE2 0x01			//Mode  register  2
+#define SUBADR1 0x02		//I2C-bus subaddress 1
+#define SUBADR2 0x03		//I2C-bus subaddress 2
+#define SUBADR3 0x04		//I2C-bus subaddress 3
+#define ALLCALLADR 0x05     //LED All Call I2C-bus address
+#define LED0 0x6			//LED0 start register
+#define LED0_ON_L 0x6		//LED0 output and brightness control byte 0
+#define LED0_ON_H 0x7		//LED0 output and brightness control byte 1
+#define LED0_OFF_L 0x8		//LED0 output and brightness control byte 2
+#define LED0_OFF_H 0x9		//LED0 output and brightness control byte 3
+#define LED_MULTIPLYER 4	// For the other 15 channels
+#define LED15_OFF_H (LED0_OFF_H + LED_MULTIPLYER * 15)
+#define ALLLED_ON_L 0xFA    //load all the LEDn_ON registers, byte 0 (turn 0-7 channels on)
+#define ALLLED_ON_H 0xFB	//load all the LEDn_ON registers, byte 1 (turn 8-15 channels on)
+#define ALLLED_OFF_L 0xFC	//load all the LEDn_OFF registers, byte 0 (turn 0-7 channels off)
+#define ALLLED_OFF_H 0xFD	//load all the LEDn_OFF registers, byte 1 (turn 8-15 channels off)
+#define PRE_SCALE 0xFE		//prescaler for output frequency
+#define TESTMODE 0xFF		//reserved; don't touch
+#define CLOCK_FREQ 25000000.0 //25MHz default osc clock
+#define BUFFER_SIZE 0x08  //1 byte buffer
+// MODE1 reg flags
+#define RESTART 0x80
+#define EXTCLK 0x40
+#define AI 0x20
+#define SLEEP 0x10
+#define SUB1 0x8
+#define SUB2 0x4
+#define SUB3 0x2
+#define ALLCALL 0x1
+// MODE2 reg flags
+#define INVRT 0x10
+#define OCH 0x8
+#define OUTDRV 0x4
+#define OUTNE // doesn't matter here
+// LEDn_ON_H / LEDn_OFF_H bit 4 forces the output fully on or off
+#define LED_FULL 0x10
+
+#endif
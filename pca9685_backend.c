@@ -0,0 +1,132 @@
+/* i2c backend selection and the accounting wrappers around each op
+ *
+ * Released under the MIT license
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pca9685_backend.h"
+
+static const struct pca_backend_ops *backends[] = {
+#ifndef NO_PIGPIO
+    &pca_pigpio_backend,
+#endif
+    &pca_i2cdev_backend,
+    &pca_sim_backend,
+    NULL
+};
+
+int pca_backend_open(struct pca_backend *be, const char *spec, int bus)
+{
+    const struct pca_backend_ops **ops;
+    const char *options = strchr(spec, ':');
+    size_t len = options ? (size_t)(options - spec) : strlen(spec);
+
+    memset(be, 0, sizeof(*be));
+    be->bus = bus;
+    for (ops = backends; *ops; ops++) {
+        if (strlen((*ops)->name) == len && !strncmp((*ops)->name, spec, len)) {
+            be->ops = *ops;
+            return be->ops->open(be, bus, options ? options + 1 : NULL);
+        }
+    }
+    fprintf(stderr, "Unknown i2c backend '%s'\n", spec);
+    return -ENOENT;
+}
+
+void pca_backend_close(struct pca_backend *be)
+{
+    if (be->ops) {
+        be->ops->close(be);
+        be->ops = NULL;
+    }
+}
+
+int pca_attach(struct pca_backend *be, int addr)
+{
+    return be->ops->attach(be, addr);
+}
+
+int pca_read_byte(struct pca_backend *be, int addr, int reg)
+{
+    int ret = be->ops->read_byte(be, addr, reg);
+    be->transactions++;
+    if (ret < 0) {
+        be->errors++;
+    } else {
+        be->bytes++;
+    }
+    return ret;
+}
+
+int pca_write_byte(struct pca_backend *be, int addr, int reg, uint8_t value)
+{
+    int ret = be->ops->write_byte(be, addr, reg, value);
+    be->transactions++;
+    if (ret < 0) {
+        be->errors++;
+    } else {
+        be->bytes++;
+    }
+    if (be->trace) be->trace(be, addr, reg, &value, 1, ret);
+    return ret;
+}
+
+int pca_read_block(struct pca_backend *be, int addr, int reg, uint8_t *buf, int count)
+{
+    int ret;
+    if (count > be->maxBlock) return -EINVAL;
+    ret = be->ops->read_block(be, addr, reg, buf, count);
+    be->transactions++;
+    if (ret < 0) {
+        be->errors++;
+    } else {
+        be->bytes += ret;
+    }
+    return ret;
+}
+
+int pca_write_block(struct pca_backend *be, int addr, int reg, const uint8_t *buf, int count)
+{
+    int ret;
+    if (count > be->maxBlock) return -EINVAL;
+    ret = be->ops->write_block(be, addr, reg, buf, count);
+    be->transactions++;
+    if (ret < 0) {
+        be->errors++;
+    } else {
+        be->bytes += count;
+    }
+    if (be->trace) be->trace(be, addr, reg, buf, count, ret);
+    return ret;
+}
+
+int pca_write_multi(struct pca_backend *be, const struct pca_xfer *xfers, int count)
+{
+    int i, j, n, ret;
+
+    for (i = 0; i < count; i++) {
+        if (xfers[i].count > be->maxBlock) return -EINVAL;
+    }
+    if (!be->ops->write_multi) {
+        for (i = 0; i < count; i++) {
+            ret = pca_write_block(be, xfers[i].addr, xfers[i].reg, xfers[i].buf, xfers[i].count);
+            if (ret < 0) return ret;
+        }
+        return count;
+    }
+    for (i = 0; i < count; i += n) {
+        n = count - i < be->maxMulti ? count - i : be->maxMulti;
+        ret = be->ops->write_multi(be, xfers + i, n);
+        be->transactions++;
+        if (ret < 0) be->errors++;
+        for (j = i; j < i + n; j++) {
+            if (ret >= 0) be->bytes += xfers[j].count;
+            if (be->trace) be->trace(be, xfers[j].addr, xfers[j].reg, xfers[j].buf, xfers[j].count, ret);
+        }
+        if (ret < 0) return ret;
+    }
+    return count;
+}
@@ -0,0 +1,71 @@
+/* i2c backends for the PCA9685 servo daemon
+ *
+ * Every register access the daemon makes goes through one of these, so the same
+ * daemon can talk to pigpiod or to a simulated chip. Each op returns < 0 on failure;
+ * read_byte returns the byte read and the block calls return the count transferred.
+ * Addresses are 7-bit i2c addresses, so several chips (or a broadcast address) can
+ * share one open bus.
+ *
+ * Released under the MIT license
+ */
+
+#ifndef PCA9685_BACKEND_H
+#define PCA9685_BACKEND_H
+
+#include <stdint.h>
+
+struct pca_backend;
+
+// one block write in a batch
+struct pca_xfer {
+    int addr;
+    int reg;
+    const uint8_t *buf;
+    int count;
+};
+
+struct pca_backend_ops {
+    const char *name;
+    // options is whatever followed a ':' in the --backend argument, or NULL
+    int (*open)(struct pca_backend *be, int bus, const char *options);
+    void (*close)(struct pca_backend *be);
+    // called once for every chip address we intend to use
+    int (*attach)(struct pca_backend *be, int addr);
+    int (*read_byte)(struct pca_backend *be, int addr, int reg);
+    int (*write_byte)(struct pca_backend *be, int addr, int reg, uint8_t value);
+    int (*read_block)(struct pca_backend *be, int addr, int reg, uint8_t *buf, int count);
+    int (*write_block)(struct pca_backend *be, int addr, int reg, const uint8_t *buf, int count);
+    // optional: send several block writes as one bus transaction. Backends without
+    // it get them sent one after another by pca_write_multi()
+    int (*write_multi)(struct pca_backend *be, const struct pca_xfer *xfers, int count);
+};
+
+struct pca_backend {
+    const struct pca_backend_ops *ops;
+    int bus;
+    int maxBlock;               // largest block transfer the backend can do, in bytes
+    int maxMulti;               // most writes write_multi can take at once
+    void *priv;
+    unsigned long transactions; // i2c transactions issued
+    unsigned long bytes;        // data bytes moved, not counting address or register
+    unsigned long errors;       // transactions that failed
+    // optional: told about every block of registers written, e.g. to record it,
+    // with result < 0 if the write failed. Called on the thread doing the write.
+    void (*trace)(struct pca_backend *be, int addr, int reg, const uint8_t *buf, int count, int result);
+};
+
+extern const struct pca_backend_ops pca_pigpio_backend;
+extern const struct pca_backend_ops pca_sim_backend;
+extern const struct pca_backend_ops pca_i2cdev_backend;
+
+// spec is "name" or "name:options", e.g. "sim:latency=200us"
+int pca_backend_open(struct pca_backend *be, const char *spec, int bus);
+void pca_backend_close(struct pca_backend *be);
+int pca_attach(struct pca_backend *be, int addr);
+int pca_read_byte(struct pca_backend *be, int addr, int reg);
+int pca_write_byte(struct pca_backend *be, int addr, int reg, uint8_t value);
+int pca_read_block(struct pca_backend *be, int addr, int reg, uint8_t *buf, int count);
+int pca_write_block(struct pca_backend *be, int addr, int reg, const uint8_t *buf, int count);
+int pca_write_multi(struct pca_backend *be, const struct pca_xfer *xfers, int count);
+
+#endif
@@ -0,0 +1,509 @@
+/* Client library for the PCA9685 servo daemon
+ *
+ * Released under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "pca9685_client.h"
+
+#define MAX_TEXT_LINE   1000    // the daemon takes lines of up to 1023 characters
+#define MAX_OUTSTANDING 256     // batches written and not yet answered
+#define MAX_COALESCE    256     // servos a batch keeps an index of; the daemon's limit
+
+// a batch waiting for its answer
+struct outstanding {
+    uint32_t seq;               // 0 for a query, whose answer nobody else wants
+    uint64_t queuedNSec;
+    uint64_t sentNSec;
+};
+
+struct pca_client {
+    enum pca_client_transport transport;
+    int fd;
+    unsigned windowUSec;
+    pca_client_reply_fn *onReply;
+    void *replyArg;
+
+    // the batch being collected
+    struct pca_msg_item items[PCA_PROTO_MAX_ITEMS];
+    int count;
+    int16_t where[MAX_COALESCE];    // index into items of each servo, or -1
+    uint64_t queuedNSec;
+    int textLen;                // the batch as a command line, newline included
+
+    uint32_t seq;               // the last batch written
+    struct outstanding waiting[MAX_OUTSTANDING];
+    unsigned head, tail;        // waiting[head..tail) in order, modulo MAX_OUTSTANDING
+    int refused;                // since the last pca_client_sync()
+
+    // control socket replies not yet split into lines
+    char in[4096];
+    int inLen;
+    struct pca_client_position *queryPos;
+    int queryFound;
+
+    struct pca_client_stats stats;
+};
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int is_text(const struct pca_client *client)
+{
+    return client->transport != PCA_CLIENT_SOCKET;
+}
+
+static int connect_socket(const char *path, int type)
+{
+    struct sockaddr_un addr;
+    int fd, err;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0)) < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+struct pca_client *pca_client_open(const char *path, enum pca_client_transport transport)
+{
+    struct pca_client *client;
+    struct stat st;
+    int fd;
+
+    if (stat(path, &st) < 0) return NULL;
+    if (transport == PCA_CLIENT_AUTO) {
+        transport = S_ISFIFO(st.st_mode) ? PCA_CLIENT_FIFO : PCA_CLIENT_SOCKET;
+    }
+    if (transport == PCA_CLIENT_FIFO) {
+        if (!S_ISFIFO(st.st_mode)) {
+            errno = EPROTOTYPE;
+            return NULL;
+        }
+        // waits for the daemon to have it open, which it always does while running
+        fd = open(path, O_WRONLY | O_CLOEXEC);
+    } else {
+        fd = connect_socket(path, transport == PCA_CLIENT_SOCKET ? SOCK_SEQPACKET : SOCK_STREAM);
+    }
+    if (fd < 0) return NULL;
+
+    if ((client = calloc(1, sizeof(*client))) == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    client->transport = transport;
+    client->fd = fd;
+    client->windowUSec = PCA_CLIENT_DEFAULT_WINDOW_USEC;
+    memset(client->where, 0xff, sizeof(client->where));
+    return client;
+}
+
+void pca_client_set_window(struct pca_client *client, unsigned windowUSec)
+{
+    client->windowUSec = windowUSec;
+}
+
+void pca_client_on_reply(struct pca_client *client, pca_client_reply_fn *fn, void *arg)
+{
+    client->onReply = fn;
+    client->replyArg = arg;
+}
+
+int pca_client_fd(const struct pca_client *client)
+{
+    return client->fd;
+}
+
+void pca_client_get_stats(const struct pca_client *client, struct pca_client_stats *stats)
+{
+    *stats = client->stats;
+}
+
+// how an item reads in a command line, without the separating comma
+static int format_item(const struct pca_msg_item *item, char *buf, size_t size)
+{
+    const char *sign = !(item->flags & PCA_ITEM_RELATIVE) ? "" : item->value < 0 ? "-" : "+";
+    uint32_t value = item->value < 0 ? -(uint32_t)item->value : (uint32_t)item->value;
+    int n;
+
+    if (item->kind == PCA_VALUE_PERMYRIAD) {
+        n = snprintf(buf, size, "%u=%s%u.%02u%%", item->servo, sign, value / 100, value % 100);
+    } else {
+        n = snprintf(buf, size, "%u=%s%uus", item->servo, sign, value);
+    }
+    if (item->durationMSec && n < (int)size) {
+        n += snprintf(buf + n, size - n, "@%ums", item->durationMSec);
+    }
+    return n;
+}
+
+// the oldest batch still waiting for its answer has got one
+static void answered(struct pca_client *client, int status, int badItem)
+{
+    struct outstanding *w = &client->waiting[client->head % MAX_OUTSTANDING];
+    struct pca_client_reply reply;
+
+    client->head++;
+    if (w->seq == 0) return;
+    if (status != PCA_STATUS_OK) {
+        client->refused++;
+        client->stats.refused++;
+    }
+    if (client->onReply) {
+        reply.seq = w->seq;
+        reply.status = status;
+        reply.badItem = badItem;
+        reply.queuedNSec = w->queuedNSec;
+        reply.sentNSec = w->sentNSec;
+        reply.replyNSec = now_nsec();
+        client->onReply(client->replyArg, &reply);
+    }
+}
+
+// a line from the control socket: an answer, or part of a query's
+static void control_reply(struct pca_client *client, const char *line)
+{
+    const struct outstanding *w = &client->waiting[client->head % MAX_OUTSTANDING];
+    struct pca_client_position *pos = client->queryPos;
+    char *p;
+
+    if (client->head == client->tail) return;
+    if (!strcmp(line, "ok")) {
+        answered(client, PCA_STATUS_OK, 0);
+    } else if (!strcmp(line, "error")) {
+        answered(client, PCA_STATUS_BAD_VALUE, 0);
+    } else if (w->seq == 0 && pos) {
+        // "3 50.00% 1500.0us" and perhaps " moving"
+        strtol(line, &p, 10);
+        pos->percent = strtod(p, &p);
+        if (*p == '%') p++;
+        pos->usec = strtod(p, &p);
+        pos->moving = strstr(p, " moving") != NULL;
+        client->queryFound = 1;
+    }
+}
+
+// Pick up whatever answers have arrived, waiting up to timeoutMSec for the first
+// if there are none yet. Returns 0 or a negative errno.
+static int read_replies(struct pca_client *client, int timeoutMSec)
+{
+    struct pollfd pfd = { client->fd, POLLIN, 0 };
+    struct pca_msg_ack ack;
+    char *line, *nl;
+    ssize_t n;
+    int ret;
+
+    if (client->transport == PCA_CLIENT_FIFO || client->head == client->tail) return 0;
+    if (timeoutMSec && (ret = poll(&pfd, 1, timeoutMSec)) <= 0) {
+        return ret < 0 && errno != EINTR ? -errno : 0;
+    }
+    for (;;) {
+        if (client->transport == PCA_CLIENT_SOCKET) {
+            n = recv(client->fd, &ack, sizeof(ack), MSG_DONTWAIT);
+        } else {
+            n = recv(client->fd, client->in + client->inLen, sizeof(client->in) - 1 - client->inLen, MSG_DONTWAIT);
+        }
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -errno;
+        if (n == 0) return -EPIPE;
+
+        if (client->transport == PCA_CLIENT_SOCKET) {
+            if (n < (ssize_t)sizeof(ack) || ack.magic != PCA_PROTO_MAGIC) continue;
+            // acks come back in order; one the daemon couldn't send counts as refused
+            while (client->head != client->tail
+                    && client->waiting[client->head % MAX_OUTSTANDING].seq != ack.seq) {
+                answered(client, PCA_STATUS_BAD_LENGTH, 0);
+            }
+            if (client->head != client->tail) answered(client, ack.status, ack.badItem);
+            continue;
+        }
+
+        client->inLen += n;
+        client->in[client->inLen] = '\0';
+        for (line = client->in; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+            *nl = '\0';
+            control_reply(client, line);
+        }
+        client->inLen -= line - client->in;
+        memmove(client->in, line, client->inLen);
+        // a line longer than the buffer is no answer we know
+        if (client->inLen == sizeof(client->in) - 1) client->inLen = 0;
+    }
+}
+
+// wait until no more than left batches are waiting for answers
+static int wait_replies(struct pca_client *client, unsigned left, int timeoutMSec)
+{
+    uint64_t deadline = now_nsec() + (uint64_t)timeoutMSec * 1000000;
+    uint64_t now;
+    int ret;
+
+    while (client->tail - client->head > left) {
+        now = now_nsec();
+        if (now >= deadline) return -ETIMEDOUT;
+        if ((ret = read_replies(client, (int)((deadline - now + 999999) / 1000000))) < 0) return ret;
+    }
+    return 0;
+}
+
+static int write_all(struct pca_client *client, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if (client->transport == PCA_CLIENT_FIFO) {
+            n = write(client->fd, p, len);
+        } else {
+            n = send(client->fd, p, len, MSG_NOSIGNAL);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+long pca_client_flush(struct pca_client *client)
+{
+    char buf[PCA_MSG_MAX_SIZE > MAX_TEXT_LINE + 64 ? PCA_MSG_MAX_SIZE : MAX_TEXT_LINE + 64];
+    struct pca_msg_header hdr;
+    struct outstanding *w;
+    size_t len = 0;
+    int i, ret;
+
+    if (client->count == 0) return 0;
+    // make room to remember this one, which pushes back on a client writing faster
+    // than the daemon answers
+    if (client->transport != PCA_CLIENT_FIFO
+            && (ret = wait_replies(client, MAX_OUTSTANDING - 1, 1000)) < 0) {
+        return ret;
+    }
+
+    client->seq = client->seq == UINT32_MAX ? 1 : client->seq + 1;
+    if (is_text(client)) {
+        for (i = 0; i < client->count; i++) {
+            if (i) buf[len++] = ',';
+            len += format_item(&client->items[i], buf + len, sizeof(buf) - len);
+        }
+        buf[len++] = '\n';
+    } else {
+        hdr.magic = PCA_PROTO_MAGIC;
+        hdr.version = PCA_PROTO_VERSION;
+        hdr.op = PCA_OP_SET;
+        hdr.seq = client->seq;
+        hdr.flags = PCA_FLAG_ACK;
+        hdr.count = client->count;
+        memcpy(buf, &hdr, sizeof(hdr));
+        memcpy(buf + sizeof(hdr), client->items, client->count * sizeof(struct pca_msg_item));
+        len = sizeof(hdr) + client->count * sizeof(struct pca_msg_item);
+    }
+    // a binary message has to go in one send; a line can't be split either, since
+    // other clients may be writing to the same FIFO
+    if ((ret = write_all(client, buf, len)) < 0) return ret;
+
+    if (client->transport != PCA_CLIENT_FIFO) {
+        w = &client->waiting[client->tail++ % MAX_OUTSTANDING];
+        w->seq = client->seq;
+        w->queuedNSec = client->queuedNSec;
+        w->sentNSec = now_nsec();
+    }
+    client->stats.batches++;
+    client->stats.bytes += len;
+    for (i = 0; i < client->count; i++) {
+        if (client->items[i].servo < MAX_COALESCE) client->where[client->items[i].servo] = -1;
+    }
+    client->count = 0;
+    client->textLen = 0;
+    if ((ret = read_replies(client, 0)) < 0) return ret;
+    return client->seq;
+}
+
+long pca_client_due_usec(const struct pca_client *client)
+{
+    uint64_t due, now;
+
+    if (client->count == 0) return -1;
+    due = client->queuedNSec + client->windowUSec * 1000ULL;
+    now = now_nsec();
+    return now >= due ? 0 : (long)((due - now) / 1000);
+}
+
+int pca_client_poll(struct pca_client *client)
+{
+    long ret;
+
+    if (pca_client_due_usec(client) == 0 && (ret = pca_client_flush(client)) < 0) return ret;
+    return read_replies(client, 0);
+}
+
+// put one item in the batch, writing the batch first if it is due, or if the item
+// doesn't fit in it
+static int add_item(struct pca_client *client, const struct pca_msg_item *item)
+{
+    struct pca_msg_item *old = NULL;
+    char text[64];
+    int64_t sum;
+    long ret;
+    int len = 0;
+
+    if (item->kind > PCA_VALUE_PERMYRIAD) return -EINVAL;
+    if (is_text(client)) {
+        // no text unit for ticks, and a minus sign would make it relative
+        if (item->kind == PCA_VALUE_TICKS
+                || (item->value < 0 && !(item->flags & PCA_ITEM_RELATIVE))) return -EINVAL;
+        len = format_item(item, text, sizeof(text)) + 1;
+    }
+    if (pca_client_due_usec(client) == 0 && (ret = pca_client_flush(client)) < 0) return ret;
+
+    if (item->servo < MAX_COALESCE && client->where[item->servo] >= 0) {
+        old = &client->items[client->where[item->servo]];
+        // the daemon would apply one after the other, so a setting replaces what
+        // came before it and a nudge adds to it; only mixed units need both
+        if (item->flags & PCA_ITEM_RELATIVE && old->kind != item->kind) old = NULL;
+    }
+    if (old && item->flags & PCA_ITEM_RELATIVE) {
+        // A nudge taking a setting below zero is refused by the daemon, and folded
+        // in it would go out as a nudge itself or be read as unsigned, so it has
+        // to go separately
+        sum = (int64_t)old->value + item->value;
+        if (sum > INT32_MAX || sum < INT32_MIN || (sum < 0 && !(old->flags & PCA_ITEM_RELATIVE))) {
+            old = NULL;
+        }
+    }
+    if (old) {
+        if (is_text(client)) client->textLen -= format_item(old, text, sizeof(text)) + 1;
+        if (item->flags & PCA_ITEM_RELATIVE) {
+            old->value += item->value;
+            old->durationMSec = item->durationMSec;
+        } else {
+            *old = *item;
+        }
+        if (is_text(client)) client->textLen += format_item(old, text, sizeof(text)) + 1;
+        client->stats.calls++;
+        client->stats.replaced++;
+        return 0;
+    }
+
+    if (client->count == PCA_PROTO_MAX_ITEMS || client->textLen + len > MAX_TEXT_LINE
+            || (item->servo < MAX_COALESCE && client->where[item->servo] >= 0)) {
+        if ((ret = pca_client_flush(client)) < 0) return ret;
+    }
+    if (client->count == 0) client->queuedNSec = now_nsec();
+    if (item->servo < MAX_COALESCE) client->where[item->servo] = client->count;
+    client->items[client->count++] = *item;
+    client->textLen += len;
+    client->stats.calls++;
+    return 0;
+}
+
+// after a call: a zero window means write it now
+static int finish_call(struct pca_client *client)
+{
+    long ret;
+
+    if (client->windowUSec == 0 && (ret = pca_client_flush(client)) < 0) return ret;
+    return 0;
+}
+
+int pca_client_move(struct pca_client *client, unsigned servo, int kind, int32_t value,
+        uint32_t durationMSec)
+{
+    struct pca_msg_item item;
+    int ret;
+
+    if (servo > UINT16_MAX) return -EINVAL;
+    item.servo = servo;
+    item.kind = kind;
+    item.flags = 0;
+    item.value = value;
+    item.durationMSec = durationMSec;
+    if ((ret = add_item(client, &item)) < 0) return ret;
+    return finish_call(client);
+}
+
+int pca_client_set(struct pca_client *client, unsigned servo, int kind, int32_t value)
+{
+    return pca_client_move(client, servo, kind, value, 0);
+}
+
+int pca_client_set_many(struct pca_client *client, const struct pca_msg_item *items, int count)
+{
+    int i, ret;
+
+    for (i = 0; i < count; i++) {
+        if ((ret = add_item(client, &items[i])) < 0) return ret;
+    }
+    return finish_call(client);
+}
+
+int pca_client_sync(struct pca_client *client, int timeoutMSec)
+{
+    long ret;
+    int refused;
+
+    if ((ret = pca_client_flush(client)) < 0) return ret;
+    if ((ret = wait_replies(client, 0, timeoutMSec)) < 0) return ret;
+    refused = client->refused;
+    client->refused = 0;
+    return refused;
+}
+
+int pca_client_query(struct pca_client *client, unsigned servo, struct pca_client_position *pos)
+{
+    struct outstanding *w;
+    char line[32];
+    long ret;
+    int len;
+
+    if (client->transport != PCA_CLIENT_CONTROL) return -EOPNOTSUPP;
+    // after anything batched has been answered, so the answer reflects it and
+    // the replies to those aren't taken for the answer to this
+    if ((ret = pca_client_flush(client)) < 0
+            || (ret = wait_replies(client, 0, 1000)) < 0) return ret;
+    len = snprintf(line, sizeof(line), "?%u %% us\n", servo);
+    if ((ret = write_all(client, line, len)) < 0) return ret;
+    w = &client->waiting[client->tail++ % MAX_OUTSTANDING];
+    w->seq = 0;
+    client->queryPos = pos;
+    client->queryFound = 0;
+    ret = wait_replies(client, 0, 1000);
+    client->queryPos = NULL;
+    if (ret < 0) return ret;
+    return client->queryFound ? 0 : -EINVAL;
+}
+
+void pca_client_close(struct pca_client *client)
+{
+    pca_client_flush(client);
+    close(client->fd);
+    free(client);
+}
@@ -0,0 +1,113 @@
+/* Client library for the PCA9685 servo daemon
+ *
+ * Typed calls in place of hand-formatted command strings, over whichever of the
+ * daemon's inputs suits: the command FIFO, the binary --socket or the text
+ * --control socket. Calls aren't written one by one; they collect in a batch that
+ * goes out as a single write (one command line, or one binary message) when it is
+ * flushed, when it fills up, or when a call finds it has been waiting longer than
+ * the batch window, a PWM frame by default. Setting a servo that is already in the
+ * batch replaces it there, as the daemon would have.
+ *
+ * Writes don't wait for the daemon's answer. Over the sockets every batch gets one,
+ * and those are picked up as the library goes, handed to the reply callback if
+ * there is one, and counted; pca_client_sync() waits for all of them. A FIFO has
+ * no replies, so there is nothing to wait for.
+ *
+ * A pca_client is not thread safe; give each thread its own. Lines written to the
+ * FIFO are kept under PIPE_BUF, so clients sharing it never interleave.
+ *
+ * Link with libpca9685client.a.
+ *
+ * Released under the MIT license
+ */
+
+#ifndef PCA9685_CLIENT_H
+#define PCA9685_CLIENT_H
+
+#include <stdint.h>
+#include "pca9685_proto.h"
+
+enum pca_client_transport {
+    PCA_CLIENT_AUTO,            // the FIFO or the binary socket, whichever path is
+    PCA_CLIENT_FIFO,
+    PCA_CLIENT_SOCKET,          // --socket, binary messages
+    PCA_CLIENT_CONTROL,         // --control, text lines; the only one that can query
+};
+
+#define PCA_CLIENT_DEFAULT_WINDOW_USEC 20000
+
+struct pca_client;
+
+// what the daemon made of one batch
+struct pca_client_reply {
+    uint32_t seq;               // as returned by pca_client_flush()
+    int status;                 // enum pca_status; "error" on the control socket
+                                // comes back as PCA_STATUS_BAD_VALUE
+    int badItem;                // which item, over the binary socket
+    uint64_t queuedNSec;        // CLOCK_MONOTONIC when the batch's first call was made
+    uint64_t sentNSec;          // when the batch was written
+    uint64_t replyNSec;         // when the answer was picked up
+};
+
+typedef void pca_client_reply_fn(void *arg, const struct pca_client_reply *reply);
+
+struct pca_client_stats {
+    unsigned long calls;        // servo settings asked for
+    unsigned long replaced;     // of those, settings a later call in the batch replaced
+    unsigned long batches;      // writes made
+    unsigned long bytes;
+    unsigned long refused;      // batches answered with anything but OK
+};
+
+// where a servo is, from pca_client_query()
+struct pca_client_position {
+    double percent;             // of the servo's min..max range
+    double usec;
+    int moving;                 // in the middle of a timed move
+};
+
+// Connect to the daemon at path. Returns NULL with errno set if that fails, or
+// EPROTOTYPE if path isn't the kind of thing the transport wants.
+struct pca_client *pca_client_open(const char *path, enum pca_client_transport transport);
+
+// write anything still batched and disconnect, without waiting for replies
+void pca_client_close(struct pca_client *client);
+
+// how long a batch may collect calls; 0 writes every call straight away
+void pca_client_set_window(struct pca_client *client, unsigned windowUSec);
+void pca_client_on_reply(struct pca_client *client, pca_client_reply_fn *fn, void *arg);
+
+// Set one servo, or move it there over durationMSec. kind is an enum
+// pca_value_kind; the text transports have no way to say ticks. Returns 0 or a
+// negative errno.
+int pca_client_set(struct pca_client *client, unsigned servo, int kind, int32_t value);
+int pca_client_move(struct pca_client *client, unsigned servo, int kind, int32_t value,
+    uint32_t durationMSec);
+
+// add several at once, relative ones (PCA_ITEM_RELATIVE) included
+int pca_client_set_many(struct pca_client *client, const struct pca_msg_item *items, int count);
+
+// Write the batch now. Returns its sequence number, 0 if there was nothing to
+// write, or a negative errno.
+long pca_client_flush(struct pca_client *client);
+
+// write the batch if its window is up and pick up any replies that have come in,
+// without blocking on the daemon; 0 or a negative errno
+int pca_client_poll(struct pca_client *client);
+
+// microseconds until pca_client_poll() would write the batch, or -1 if it's empty
+long pca_client_due_usec(const struct pca_client *client);
+
+// Flush and wait up to timeoutMSec for every reply. Returns how many batches were
+// refused since the last sync, or a negative errno such as -ETIMEDOUT.
+int pca_client_sync(struct pca_client *client, int timeoutMSec);
+
+// ask where a servo is; PCA_CLIENT_CONTROL only, -EOPNOTSUPP otherwise
+int pca_client_query(struct pca_client *client, unsigned servo, struct pca_client_position *pos);
+
+void pca_client_get_stats(const struct pca_client *client, struct pca_client_stats *stats);
+
+// to wait on in a poll() loop of one's own: readable when replies are in
+int pca_client_fd(const struct pca_client *client);
+
+#endif // PCA9685_CLIENT_H
@@ -0,0 +1,153 @@
+/* Command line parser for the PCA9685 servo daemon
+ *
+ * Released under the MIT license
+ */
+
+#include <string.h>
+
+#include "pca9685_parse.h"
+
+// more whole digits than any width or move time needs; it keeps the fixed point
+// arithmetic well clear of overflowing
+#define MAX_WHOLE 999999999
+
+const char *const pca_curve_names[PCA_NUM_CURVES] = { "linear", "in", "out", "inout" };
+
+static int is_digit(char c) { return c >= '0' && c <= '9'; }
+static int is_alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+static int is_blank(char c) { return c == ' ' || c == '\t'; }
+static int is_space(char c) { return is_blank(c) || c == '\r' || c == '\n'; }
+
+// read digits with an optional fraction into fixed point. Digits past the sixth
+// decimal place are skipped. Returns where the number ends, or NULL if there isn't
+// one or it is too big.
+static const char *parse_number(const char *p, const char *end, int64_t *value)
+{
+    int64_t whole = 0, frac = 0, scale = PCA_PARSE_SCALE;
+
+    if (p == end || !is_digit(*p)) return NULL;
+    for (; p < end && is_digit(*p); p++) {
+        whole = whole * 10 + (*p - '0');
+        if (whole > MAX_WHOLE) return NULL;
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && is_digit(*p); p++) {
+            if (scale > 1) {
+                scale /= 10;
+                frac += (*p - '0') * scale;
+            }
+        }
+    }
+    *value = whole * PCA_PARSE_SCALE + frac;
+    return p;
+}
+
+// does [p, end) start with the given word?
+static int starts_with(const char *p, const char *end, const char *word, size_t len)
+{
+    return (size_t)(end - p) >= len && !memcmp(p, word, len);
+}
+
+const char *pca_parse_move(const char *p, const char *end, uint32_t *durationMSec, uint8_t *curve)
+{
+    const char *name;
+    int64_t duration;
+    int i;
+
+    if ((p = parse_number(p, end, &duration)) == NULL) return NULL;
+    if (starts_with(p, end, "ms", 2)) {
+        p += 2;
+    } else if (p < end && *p == 's') {
+        duration *= 1000;
+        p++;
+    }
+    duration /= PCA_PARSE_SCALE;
+    *durationMSec = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+    *curve = PCA_CURVE_LINEAR;
+    if (p < end && *p == ':') {
+        for (name = ++p; p < end && is_alpha(*p); p++)
+            ;
+        for (i = 0; i < PCA_NUM_CURVES; i++) {
+            if (strlen(pca_curve_names[i]) == (size_t)(p - name)
+                    && !memcmp(pca_curve_names[i], name, p - name)) break;
+        }
+        if (i == PCA_NUM_CURVES) return NULL;
+        *curve = i;
+    }
+    return p;
+}
+
+int pca_parse_next(struct pca_parser *ps, struct pca_assignment *a)
+{
+    const char *p = ps->pos, *end = ps->end;
+    uint32_t servo;
+
+    // skip empty assignments, as in "0=10%,,1=20%" or after a trailing comma
+    for (;;) {
+        while (p < end && is_space(*p)) p++;
+        if (p == end) {
+            ps->pos = p;
+            return PCA_PARSE_DONE;
+        }
+        if (*p != ',') break;
+        p++;
+    }
+    ps->pos = p;
+
+    // what to set
+    if (*p == '*') {
+        a->target = PCA_TARGET_ALL;
+        p++;
+    } else if (is_digit(*p)) {
+        a->target = PCA_TARGET_SERVO;
+        for (servo = 0; p < end && is_digit(*p); p++) {
+            servo = servo > (UINT32_MAX - 9) / 10 ? UINT32_MAX : servo * 10 + (*p - '0');
+        }
+        a->servo = servo;
+    } else if (is_alpha(*p)) {
+        a->target = PCA_TARGET_GROUP;
+        a->name = p;
+        for (p++; p < end && (is_alpha(*p) || is_digit(*p) || *p == '_'); p++)
+            ;
+        a->nameLen = p - a->name;
+    } else {
+        return PCA_PARSE_SYNTAX;
+    }
+    while (p < end && is_blank(*p)) p++;
+    if (p == end || *p != '=') return PCA_PARSE_SYNTAX;
+    for (p++; p < end && is_blank(*p); p++)
+        ;
+
+    // the width: an optional sign, a number and its unit
+    a->sign = 0;
+    if (p < end && (*p == '+' || *p == '-')) {
+        a->sign = *p++ == '+' ? 1 : -1;
+    }
+    if ((p = parse_number(p, end, &a->value)) == NULL) return PCA_PARSE_WIDTH;
+    if (p < end && *p == '%') {
+        a->unit = PCA_UNIT_PERCENT;
+        p++;
+    } else if (starts_with(p, end, "us", 2)) {
+        a->unit = PCA_UNIT_USEC;
+        p += 2;
+    } else {
+        a->unit = PCA_UNIT_STEPS;
+    }
+
+    // an optional move time in ms or s, and easing curve
+    a->durationMSec = 0;
+    a->curve = PCA_CURVE_LINEAR;
+    if (p < end && *p == '@') {
+        if ((p = pca_parse_move(p + 1, end, &a->durationMSec, &a->curve)) == NULL) return PCA_PARSE_DURATION;
+        while (p < end && is_space(*p)) p++;
+        if (p < end && *p != ',') return PCA_PARSE_DURATION;
+    }
+
+    while (p < end && is_space(*p)) p++;
+    if (p < end) {
+        if (*p != ',') return PCA_PARSE_WIDTH;
+        p++;
+    }
+    ps->pos = p;
+    return PCA_PARSE_OK;
+}
@@ -0,0 +1,78 @@
+/* Command line parser for the PCA9685 servo daemon
+ *
+ * Turns one text command line such as
+ *   0=50%,3=1200us,7=+10,legs=80%@750ms:inout
+ * into a sequence of pca_assignments, one call to pca_parse_next() at a time. It
+ * works straight off the caller's buffer in a single pass: it never writes to it,
+ * never reads past the end it is given, allocates nothing and doesn't go through
+ * strtod() or the scanf family, so the decimal point is always '.' whatever the
+ * locale. It only checks the syntax; whether a servo or group exists and whether a
+ * width is in range is up to the caller.
+ *
+ * Released under the MIT license
+ */
+
+#ifndef PCA9685_PARSE_H
+#define PCA9685_PARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// numbers are kept as fixed point with six decimal places
+#define PCA_PARSE_SCALE 1000000
+
+enum pca_target_kind {
+    PCA_TARGET_SERVO,           // a servo number
+    PCA_TARGET_ALL,             // '*'
+    PCA_TARGET_GROUP,           // a name, which starts with a letter
+};
+
+enum pca_unit {
+    PCA_UNIT_STEPS,             // a bare number
+    PCA_UNIT_USEC,              // "us"
+    PCA_UNIT_PERCENT,           // "%" of the servo's range
+};
+
+enum pca_curve { PCA_CURVE_LINEAR, PCA_CURVE_IN, PCA_CURVE_OUT, PCA_CURVE_INOUT, PCA_NUM_CURVES };
+extern const char *const pca_curve_names[PCA_NUM_CURVES];
+
+struct pca_assignment {
+    uint8_t target;             // enum pca_target_kind
+    uint8_t unit;               // enum pca_unit
+    int8_t sign;                // 0 for an absolute width, +1 or -1 for a relative one
+    uint8_t curve;              // enum pca_curve
+    uint32_t servo;             // for PCA_TARGET_SERVO; saturates rather than wrapping
+    const char *name;           // for PCA_TARGET_GROUP, pointing into the line
+    size_t nameLen;
+    int64_t value;              // the width without its sign, times PCA_PARSE_SCALE
+    uint32_t durationMSec;      // 0 to jump straight there; saturates too
+};
+
+enum pca_parse_status {
+    PCA_PARSE_DONE = 0,         // nothing more on the line
+    PCA_PARSE_OK = 1,           // the assignment has been filled in
+    PCA_PARSE_SYNTAX = -1,      // not target=width
+    PCA_PARSE_WIDTH = -2,       // the width isn't a number with a known unit
+    PCA_PARSE_DURATION = -3,    // bad move time or curve name
+};
+
+struct pca_parser {
+    const char *pos;
+    const char *end;
+};
+
+static inline void pca_parse_init(struct pca_parser *ps, const char *line, size_t len)
+{
+    ps->pos = line;
+    ps->end = line + len;
+}
+
+// parse a move time in ms (the default) or s, optionally followed by ':' and an
+// easing curve, as after the '@' in an assignment. Returns where it ends, or NULL
+// if it isn't one.
+const char *pca_parse_move(const char *p, const char *end, uint32_t *durationMSec, uint8_t *curve);
+
+// parse the next assignment. After an error ps->pos is left where it was found.
+int pca_parse_next(struct pca_parser *ps, struct pca_assignment *a);
+
+#endif // PCA9685_PARSE_H
@@ -0,0 +1,80 @@
+/* Binary command protocol for the PCA9685 servo daemon
+ *
+ * Clients connect to the daemon's SOCK_SEQPACKET unix socket (see --socket) and send
+ * one message per packet: a pca_msg_header followed by header.count pca_msg_items.
+ * Every field is in host byte order since both ends are on the same machine. If the
+ * header has PCA_FLAG_ACK set the daemon replies with a pca_msg_ack carrying the
+ * same seq. A message is checked as a whole before any of it is used, so a bad item
+ * means nothing in that message is applied.
+ *
+ * Released under the MIT license
+ */
+
+#ifndef PCA9685_PROTO_H
+#define PCA9685_PROTO_H
+
+#include <stdint.h>
+
+#define PCA_PROTO_MAGIC     0x9685
+#define PCA_PROTO_VERSION   1
+#define PCA_PROTO_MAX_ITEMS 256
+
+// header.op
+enum pca_op {
+    PCA_OP_SET = 1,             // set (or move) each item's servo
+};
+
+// header.flags
+#define PCA_FLAG_ACK        0x0001  // reply with a pca_msg_ack
+
+// item.kind: what item.value means
+enum pca_value_kind {
+    PCA_VALUE_TICKS = 0,        // pulse width in 1/4096ths of the PWM cycle
+    PCA_VALUE_USEC = 1,         // pulse width in microseconds
+    PCA_VALUE_PERMYRIAD = 2,    // 0..10000 across the servo's min..max range
+};
+
+// item.flags
+#define PCA_ITEM_RELATIVE   0x01    // add value to the servo's current target
+
+// ack.status
+enum pca_status {
+    PCA_STATUS_OK = 0,
+    PCA_STATUS_BAD_MAGIC,
+    PCA_STATUS_BAD_VERSION,
+    PCA_STATUS_BAD_OP,
+    PCA_STATUS_BAD_LENGTH,      // packet size doesn't match header.count
+    PCA_STATUS_BAD_SERVO,
+    PCA_STATUS_BAD_VALUE,       // unknown kind, or outside the servo's range
+    PCA_STATUS_STOPPED,         // thrown away unread by a stop on the priority FIFO
+};
+
+struct pca_msg_header {
+    uint16_t magic;             // PCA_PROTO_MAGIC
+    uint8_t version;            // PCA_PROTO_VERSION
+    uint8_t op;                 // enum pca_op
+    uint32_t seq;               // echoed back in the ack
+    uint16_t flags;
+    uint16_t count;             // number of items following, at most PCA_PROTO_MAX_ITEMS
+};
+
+struct pca_msg_item {
+    uint16_t servo;             // global servo number
+    uint8_t kind;               // enum pca_value_kind
+    uint8_t flags;              // PCA_ITEM_*
+    int32_t value;
+    uint32_t durationMSec;      // 0 to jump, otherwise a timed move
+};
+
+struct pca_msg_ack {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t status;             // enum pca_status
+    uint32_t seq;
+    uint16_t applied;           // items accepted
+    uint16_t badItem;           // index of the offending item when status isn't OK
+};
+
+#define PCA_MSG_MAX_SIZE (sizeof(struct pca_msg_header) + PCA_PROTO_MAX_ITEMS * sizeof(struct pca_msg_item))
+
+#endif
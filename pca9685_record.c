@@ -0,0 +1,255 @@
+/* Record log writer for the PCA9685 servo daemon
+ *
+ * The log file is sized up front and mapped shared, and each record gets its place
+ * with one atomic add, so the command thread and every bus thread can record at
+ * once without a lock or a system call. The kernel writes the pages back as it
+ * sees fit, even if the daemon dies, and closing only has to trim the file.
+ *
+ * Every record also goes into the flight recorder, a fixed ring in memory that
+ * is claimed the same way. Each slot carries the sequence number of the record in
+ * it, stored last, so a dump can tell a slot it can trust from one being
+ * overwritten under it and skip the latter.
+ *
+ * Released under the MIT license
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "pca9685_record.h"
+
+static uint8_t *recordMap;
+static size_t recordSize;
+static size_t recordUsed;       // bytes handed out, which may run past recordSize
+static unsigned long recordDropped;
+static uint64_t recordStartNSec;
+static int recordFd = -1;
+
+struct flight_slot {
+    uint32_t seq;               // the record's index + 1 once written; 0 while writing
+    uint32_t reserved;
+    uint64_t timeNSec;          // CLOCK_MONOTONIC
+    struct pca_record rec;      // timeUSec is filled in when dumping
+    uint8_t payload[PCA_FLIGHT_PAYLOAD];
+};
+
+static struct flight_slot flight[PCA_FLIGHT_EVENTS];
+static unsigned long flightNext;    // records claimed so far
+static const struct pca_record_board *flightBoards;
+static int flightNumBoards;
+static int flightDumping;
+
+static uint64_t now_nsec(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int pca_record_open(const char *path, size_t maxBytes,
+        const struct pca_record_board *boards, int numBoards)
+{
+    struct pca_record_file header;
+    size_t headerLen = sizeof(header) + numBoards * sizeof(*boards);
+
+    if (maxBytes < headerLen + sizeof(struct pca_record)) return -EINVAL;
+    if ((recordFd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) return -errno;
+    if (ftruncate(recordFd, maxBytes) < 0
+            || (recordMap = mmap(NULL, maxBytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                recordFd, 0)) == MAP_FAILED) {
+        int err = -errno;
+        close(recordFd);
+        recordFd = -1;
+        recordMap = NULL;
+        return err;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = PCA_RECORD_MAGIC;
+    header.version = PCA_RECORD_VERSION;
+    header.numBoards = numBoards;
+    header.startUnixNSec = now_nsec(CLOCK_REALTIME);
+    memcpy(recordMap, &header, sizeof(header));
+    memcpy(recordMap + sizeof(header), boards, numBoards * sizeof(*boards));
+    recordSize = maxBytes;
+    recordUsed = headerLen;
+    recordStartNSec = now_nsec(CLOCK_MONOTONIC);
+    return 0;
+}
+
+// the flight recorder's copy, with the payload cut short if need be
+static void flight_add(uint64_t nsec, int type, int source, const void *head, size_t headLen,
+        const void *data, size_t len)
+{
+    unsigned long index = __atomic_fetch_add(&flightNext, 1, __ATOMIC_RELAXED);
+    struct flight_slot *slot = &flight[index & (PCA_FLIGHT_EVENTS - 1)];
+
+    if (headLen > PCA_FLIGHT_PAYLOAD) headLen = PCA_FLIGHT_PAYLOAD;
+    if (len > PCA_FLIGHT_PAYLOAD - headLen) len = PCA_FLIGHT_PAYLOAD - headLen;
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->timeNSec = nsec;
+    slot->rec.type = type;
+    slot->rec.source = source;
+    slot->rec.length = headLen + len;
+    if (headLen) memcpy(slot->payload, head, headLen);
+    if (len) memcpy(slot->payload + headLen, data, len);
+    __atomic_store_n(&slot->seq, (uint32_t)(index + 1), __ATOMIC_RELEASE);
+}
+
+void pca_record(int type, int source, const void *head, size_t headLen,
+        const void *data, size_t len)
+{
+    struct pca_record rec;
+    size_t total = sizeof(rec) + headLen + len, at;
+    uint64_t nsec = now_nsec(CLOCK_MONOTONIC);
+    uint8_t *p;
+
+    flight_add(nsec, type, source, head, headLen, data, len);
+    if (!recordMap) return;
+    if (headLen + len > UINT16_MAX) {
+        __atomic_fetch_add(&recordDropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    at = __atomic_fetch_add(&recordUsed, total, __ATOMIC_RELAXED);
+    // keep room for the end marker the zeroed file provides
+    if (at + total + sizeof(rec) > recordSize) {
+        __atomic_fetch_add(&recordDropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rec.type = type;
+    rec.source = source;
+    rec.length = headLen + len;
+    rec.timeUSec = (uint32_t)((nsec - recordStartNSec) / 1000);
+    p = recordMap + at;
+    memcpy(p, &rec, sizeof(rec));
+    if (headLen) memcpy(p + sizeof(rec), head, headLen);
+    if (len) memcpy(p + sizeof(rec) + headLen, data, len);
+}
+
+void pca_record_close(void)
+{
+    size_t used;
+
+    if (recordFd < 0) return;
+    // Push recordUsed past the end so nothing more gets recorded; bus threads may
+    // still be running, and writing beyond the trimmed file would fault. Any space
+    // handed out but not written is zeroes, which reads as the end marker, and so
+    // is the header's worth we keep after the last record.
+    used = __atomic_fetch_add(&recordUsed, recordSize, __ATOMIC_RELAXED);
+    used += sizeof(struct pca_record);
+    if (used > recordSize) used = recordSize;
+    if (ftruncate(recordFd, used) < 0) {
+        // leave it full size; readers stop at the end marker anyway
+    }
+    close(recordFd);
+    recordFd = -1;
+}
+
+const void *pca_record_map(size_t *size)
+{
+    *size = recordSize;
+    return recordMap;
+}
+
+unsigned long pca_record_dropped(void)
+{
+    return __atomic_load_n(&recordDropped, __ATOMIC_RELAXED);
+}
+
+size_t pca_record_used(void)
+{
+    size_t used = __atomic_load_n(&recordUsed, __ATOMIC_RELAXED);
+    return used < recordSize ? used : recordSize;
+}
+
+void pca_flight_init(const struct pca_record_board *boards, int numBoards)
+{
+    flightBoards = boards;
+    flightNumBoards = numBoards;
+}
+
+unsigned long pca_flight_count(void)
+{
+    return __atomic_load_n(&flightNext, __ATOMIC_RELAXED);
+}
+
+// write() all of it, as far as that goes
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, p, len)) < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int pca_flight_dump(const char *path)
+{
+    static struct flight_slot copy;
+    struct pca_record_file header;
+    struct pca_record end;
+    unsigned long next = pca_flight_count(), index, first;
+    uint64_t firstNSec = 0;
+    int fd, ret = 0, count = 0, saved = errno;
+
+    if (next == 0) return 0;
+    // a crash while a dump is being asked for shouldn't scribble over it
+    if (__atomic_exchange_n(&flightDumping, 1, __ATOMIC_ACQUIRE)) return -EBUSY;
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        ret = -errno;
+        goto out;
+    }
+    first = next > PCA_FLIGHT_EVENTS ? next - PCA_FLIGHT_EVENTS : 0;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = PCA_RECORD_MAGIC;
+    header.version = PCA_RECORD_VERSION;
+    header.numBoards = flightNumBoards;
+    for (index = first; index < next; index++) {
+        const struct flight_slot *slot = &flight[index & (PCA_FLIGHT_EVENTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == (uint32_t)(index + 1)) {
+            firstNSec = slot->timeNSec;
+            break;
+        }
+    }
+    // the wall clock time the oldest record was made
+    header.startUnixNSec = now_nsec(CLOCK_REALTIME) - (now_nsec(CLOCK_MONOTONIC) - firstNSec);
+    if ((ret = write_all(fd, &header, sizeof(header))) < 0
+            || (ret = write_all(fd, flightBoards, flightNumBoards * sizeof(*flightBoards))) < 0) {
+        goto close;
+    }
+
+    for (index = first; index < next; index++) {
+        const struct flight_slot *slot = &flight[index & (PCA_FLIGHT_EVENTS - 1)];
+        // copy it out and check it wasn't rewritten while we did
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != (uint32_t)(index + 1)) continue;
+        memcpy(&copy, slot, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != copy.seq) continue;
+        if (copy.rec.length > PCA_FLIGHT_PAYLOAD) continue;
+        copy.rec.timeUSec = copy.timeNSec > firstNSec ? (uint32_t)((copy.timeNSec - firstNSec) / 1000) : 0;
+        // the payload follows straight on from the record header in the slot
+        if ((ret = write_all(fd, &copy.rec, sizeof(copy.rec) + copy.rec.length)) < 0) goto close;
+        count++;
+    }
+    memset(&end, 0, sizeof(end));
+    if ((ret = write_all(fd, &end, sizeof(end))) == 0) ret = count;
+close:
+    close(fd);
+out:
+    __atomic_store_n(&flightDumping, 0, __ATOMIC_RELEASE);
+    errno = saved;
+    return ret;
+}
@@ -0,0 +1,132 @@
+/* Record log format for the PCA9685 servo daemon
+ *
+ * With --record=PATH the daemon logs every command it receives and every register
+ * write it makes, with timestamps, so a run can be looked at afterwards or fed back
+ * in with pca9685replay. The log is a pca_record_file header, numBoards
+ * pca_record_board entries, then records: a pca_record header followed by
+ * 'length' bytes of payload:
+ *
+ *   PCA_REC_TEXT     a text command line, without its newline
+ *   PCA_REC_MESSAGE  a binary protocol message, exactly as received
+ *   PCA_REC_SHM      a pca_record_shm for a shared-memory slot that was picked up
+ *   PCA_REC_WRITE    the chip address, the register, then the bytes written
+ *   PCA_REC_TARGET   a pca_record_target for a position a command resolved to
+ *   PCA_REC_WRITE_FAILED  a pca_record_failure, then the bytes that weren't written
+ *
+ * A record whose type is 0 marks the end of the log. All fields are little endian,
+ * as on the Pi.
+ *
+ * The last PCA_FLIGHT_EVENTS records are also kept in memory all the time, log or
+ * no log, as a flight recorder. pca_flight_dump() writes them out in this same
+ * format, with payloads cut to PCA_FLIGHT_PAYLOAD bytes.
+ *
+ * Released under the MIT license
+ */
+
+#ifndef PCA9685_RECORD_H
+#define PCA9685_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PCA_RECORD_MAGIC   0x52414350  // "PCAR"
+#define PCA_RECORD_VERSION 1
+
+struct pca_record_file {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t numBoards;
+    uint64_t startUnixNSec;     // wall clock time the recording started
+} __attribute__((packed));
+
+struct pca_record_board {
+    uint8_t bus;
+    uint8_t address;
+    uint16_t reserved;
+    uint32_t cycleTimeUSec;
+} __attribute__((packed));
+
+enum pca_record_type {
+    PCA_REC_END,
+    PCA_REC_TEXT,
+    PCA_REC_MESSAGE,
+    PCA_REC_SHM,
+    PCA_REC_WRITE,
+    PCA_REC_TARGET,
+    PCA_REC_WRITE_FAILED,
+};
+
+// where an input record came from; write records carry the bus number instead
+enum pca_record_source {
+    PCA_SRC_FIFO,
+    PCA_SRC_CONTROL,
+    PCA_SRC_SOCKET,
+    PCA_SRC_SHM,
+    PCA_SRC_PRIORITY,
+};
+
+struct pca_record {
+    uint8_t type;               // enum pca_record_type
+    uint8_t source;             // enum pca_record_source, or the bus for PCA_REC_WRITE
+    uint16_t length;            // payload bytes that follow
+    uint32_t timeUSec;          // since the recording started; wraps after 71 minutes
+} __attribute__((packed));
+
+struct pca_record_shm {
+    uint16_t servo;
+    uint8_t kind;               // enum pca_value_kind
+    uint8_t reserved;
+    int32_t value;
+    uint32_t durationMSec;
+} __attribute__((packed));
+
+struct pca_record_target {
+    uint16_t servo;
+    uint8_t curve;              // enum pca_curve
+    uint8_t reserved;
+    int32_t width;              // 16.16 fraction of the servo's min..max range
+    uint32_t durationMSec;      // 0 for a jump
+} __attribute__((packed));
+
+struct pca_record_failure {
+    int32_t result;             // what the backend returned, a negative errno
+    uint8_t address;
+    uint8_t reg;
+} __attribute__((packed));
+
+#define PCA_FLIGHT_EVENTS  4096     // a power of two
+#define PCA_FLIGHT_PAYLOAD 104
+
+// Start recording to path, which is sized to maxBytes up front and mapped, so
+// adding a record never makes a system call or takes a lock. Records that don't
+// fit are dropped and counted.
+int pca_record_open(const char *path, size_t maxBytes,
+    const struct pca_record_board *boards, int numBoards);
+
+// add a record whose payload is head followed by data, to the flight recorder
+// and, when recording, to the log
+void pca_record(int type, int source, const void *head, size_t headLen,
+    const void *data, size_t len);
+
+// trim the file to what was recorded. Only makes async-signal-safe calls, so it
+// can be used from a signal handler.
+void pca_record_close(void);
+
+// the mapping records go into and its size, or NULL when not recording
+const void *pca_record_map(size_t *size);
+
+unsigned long pca_record_dropped(void);
+size_t pca_record_used(void);
+
+// the boards to describe in a flight recorder dump; the array must stay put
+void pca_flight_init(const struct pca_record_board *boards, int numBoards);
+
+// Write the flight recorder out to path, oldest record first, and return how many
+// records that was or a negative errno. Nothing is written if nothing has been
+// recorded. Only makes async-signal-safe calls, so a crash handler can use it.
+int pca_flight_dump(const char *path);
+
+// records added to the flight recorder since startup
+unsigned long pca_flight_count(void);
+
+#endif // PCA9685_RECORD_H
@@ -0,0 +1,110 @@
+/* Shared-memory target table for the PCA9685 servo daemon
+ *
+ * With --shm=PATH the daemon creates a file (best put on /dev/shm) holding one
+ * pca_shm_slot per servo. Clients mmap it and write targets straight into their
+ * slots; the daemon samples the table once per PWM frame and sends whatever has
+ * changed, so setting a servo costs a client a few stores rather than a system call.
+ *
+ * Each slot is a seqlock: the writer makes seq odd, fills in the slot, then makes it
+ * even again, and the daemon ignores a slot whose seq is odd or moved while it was
+ * reading. The daemon only acts when a slot's seq changes, so commands from the
+ * FIFO or socket are not overridden by stale shared-memory values. Only one
+ * process should write any one slot. Use the inline helpers below rather than
+ * touching the fields directly.
+ *
+ * Released under the MIT license
+ */
+
+#ifndef PCA9685_SHM_H
+#define PCA9685_SHM_H
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "pca9685_proto.h"
+
+#define PCA_SHM_MAGIC   0x50434153  // "PCAS"
+#define PCA_SHM_VERSION 1
+
+// one cache line per slot so clients driving different servos don't fight over lines
+struct pca_shm_slot {
+    uint32_t seq;               // odd while being written
+    uint8_t kind;               // enum pca_value_kind; relative values aren't allowed
+    uint8_t reserved[3];
+    int32_t value;
+    uint32_t durationMSec;      // 0 to jump straight there
+} __attribute__((aligned(64)));
+
+struct pca_shm_table {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t numSlots;          // servos the daemon is driving
+    uint32_t frames;            // bumped by the daemon every time it samples
+    uint32_t cycleTimeUSec;     // PWM cycle of the first board, for clients using ticks
+    struct pca_shm_slot slots[] __attribute__((aligned(64)));
+};
+
+#define PCA_SHM_SIZE(numSlots) \
+    (sizeof(struct pca_shm_table) + (numSlots) * sizeof(struct pca_shm_slot))
+
+// map the daemon's table; returns NULL if it can't be opened or isn't one
+static inline struct pca_shm_table *pca_shm_open(const char *path)
+{
+    struct pca_shm_table *table;
+    uint16_t numSlots;
+    int fd;
+
+    if ((fd = open(path, O_RDWR)) < 0) return NULL;
+    table = mmap(NULL, sizeof(*table), PROT_READ, MAP_SHARED, fd, 0);
+    if (table == MAP_FAILED || table->magic != PCA_SHM_MAGIC ||
+            table->version != PCA_SHM_VERSION) {
+        if (table != MAP_FAILED) munmap(table, sizeof(*table));
+        close(fd);
+        return NULL;
+    }
+    numSlots = table->numSlots;
+    munmap(table, sizeof(*table));
+    table = mmap(NULL, PCA_SHM_SIZE(numSlots), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return table == MAP_FAILED ? NULL : table;
+}
+
+static inline void pca_shm_close(struct pca_shm_table *table)
+{
+    munmap(table, PCA_SHM_SIZE(table->numSlots));
+}
+
+// publish a new target for one servo
+static inline void pca_shm_set(struct pca_shm_table *table, int servo, int kind,
+        int32_t value, uint32_t durationMSec)
+{
+    struct pca_shm_slot *slot = &table->slots[servo];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->kind, (uint8_t)kind, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->durationMSec, durationMSec, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// take a consistent copy of a slot; returns -1 if a write was in progress
+static inline int pca_shm_read(const struct pca_shm_table *table, int servo,
+        struct pca_shm_slot *copy)
+{
+    const struct pca_shm_slot *slot = &table->slots[servo];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    if (seq & 1) return -1;
+    copy->kind = __atomic_load_n(&slot->kind, __ATOMIC_RELAXED);
+    copy->value = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+    copy->durationMSec = __atomic_load_n(&slot->durationMSec, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) return -1;
+    copy->seq = seq;
+    return 0;
+}
+
+#endif // PCA9685_SHM_H
@@ -0,0 +1,307 @@
+/* pca9685-loadgen - drive a PCA9685 servo daemon as hard as asked and measure it
+ *
+ * M threads each sweep their own K servos through pca9685_client at a target
+ * number of settings a second between them, then report what was achieved and
+ * how long each batch took from the first call in it to the daemon's answer. Run
+ * it against a daemon on the sim backend to size a deployment without hardware,
+ * or against the real thing to see how much headroom it has. Over a FIFO there
+ * are no answers, so only the throughput is measured; --stats adds the daemon's
+ * own latency figures, input to bus write, from its control socket.
+ *
+ * Released under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "pca9685_client.h"
+
+#define MAX_SAMPLES (1 << 22)   // latency samples kept per thread
+
+struct worker {
+    pthread_t thread;
+    int index;
+    struct pca_client *client;
+    uint64_t *samples;          // nanoseconds from first call to answer, per batch
+    size_t numSamples, maxSamples;
+    unsigned long lateTicks;
+    int error;
+    struct pca_client_stats stats;
+};
+
+static int numThreads = 1, numChannels = 16, firstServo = 0;
+static double rate = 1000, seconds = 10;
+static unsigned moveMSec;
+static uint64_t startNSec, endNSec;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: pca9685-loadgen [OPTIONS]\n"
+        "  --fifo=PATH     drive the daemon through its command FIFO (the default,\n"
+        "                  /dev/pca9685servo)\n"
+        "  --socket=PATH   or its binary protocol socket\n"
+        "  --control=PATH  or its text control socket\n"
+        "  --threads=M     client threads, each with its own connection, default 1\n"
+        "  --channels=K    servos per thread, default 16; thread i drives servos\n"
+        "                  first+i*K to first+i*K+K-1\n"
+        "  --first=N       the first servo, default 0\n"
+        "  --rate=N        settings per second across all threads, default 1000\n"
+        "  --seconds=S     how long to run, default 10\n"
+        "  --window=USEC   how long the library batches calls, default %d\n"
+        "  --move=MS       send timed moves rather than jumps\n"
+        "  --stats=PATH    the daemon's control socket, to report its own latency\n",
+        PCA_CLIENT_DEFAULT_WINDOW_USEC);
+    exit(1);
+}
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t nsec)
+{
+    struct timespec ts = { nsec / 1000000000ULL, nsec % 1000000000ULL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void on_reply(void *arg, const struct pca_client_reply *reply)
+{
+    struct worker *w = arg;
+
+    if (w->numSamples < w->maxSamples) {
+        w->samples[w->numSamples++] = reply->replyNSec - reply->queuedNSec;
+    }
+}
+
+// each tick sets all of the thread's servos, sweeping them to and fro out of step
+static void *run_worker(void *arg)
+{
+    struct worker *w = arg;
+    uint64_t period = (uint64_t)(1e9 * numThreads * numChannels / rate);
+    uint64_t next = startNSec, now, wake;
+    unsigned long tick;
+    long due;
+    int ch, phase, ret = 0;
+
+    for (tick = 0; (now = now_nsec()) < endNSec; tick++) {
+        for (ch = 0; ch < numChannels && ret == 0; ch++) {
+            phase = (int)((tick * 100 + ch * 625) % 20000);
+            ret = pca_client_move(w->client, firstServo + w->index * numChannels + ch,
+                PCA_VALUE_PERMYRIAD, phase <= 10000 ? phase : 20000 - phase, moveMSec);
+        }
+        if (ret < 0 || (ret = pca_client_poll(w->client)) < 0) break;
+
+        // sleep until the next tick, waking to write the batch when it is due
+        next += period;
+        if (next < now_nsec()) {
+            w->lateTicks++;
+            continue;
+        }
+        while ((now = now_nsec()) < next) {
+            due = pca_client_due_usec(w->client);
+            wake = due >= 0 && now + due * 1000ULL < next ? now + due * 1000ULL : next;
+            sleep_until(wake);
+            if ((ret = pca_client_poll(w->client)) < 0) break;
+        }
+        if (ret < 0) break;
+    }
+    if (ret >= 0 && (ret = pca_client_sync(w->client, 5000)) > 0) ret = 0;
+    w->error = ret < 0 ? -ret : 0;
+    pca_client_get_stats(w->client, &w->stats);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// the daemon's view: the latency lines of its stats
+static void daemon_stats(const char *path)
+{
+    struct sockaddr_un addr;
+    char buf[65536], *line, *nl;
+    size_t len = 0;
+    ssize_t n;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+            || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || write(fd, "stats\n", 6) != 6) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    while (len < sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+        len += n;
+        buf[len] = '\0';
+        if (strstr(buf, "\nok\n")) break;
+    }
+    close(fd);
+    buf[len] = '\0';
+    printf("daemon:\n");
+    for (line = buf; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+        *nl = '\0';
+        if (!strncmp(line, "commands ", 9) || !strncmp(line, "coalesced ", 10)
+                || !strncmp(line, "messages ", 9) || strstr(line, "latency.")) {
+            if (!strstr(line, ".hist")) printf("  %s\n", line);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/dev/pca9685servo", *statsPath = NULL;
+    enum pca_client_transport transport = PCA_CLIENT_FIFO;
+    static const char *transportNames[] = { "", "FIFO", "binary socket", "control socket" };
+    struct worker *workers;
+    struct pca_client_stats total;
+    uint64_t *all;
+    size_t numAll = 0;
+    unsigned long lateTicks = 0;
+    long window = PCA_CLIENT_DEFAULT_WINDOW_USEC;
+    double secs;
+    int c, i, failed = 0;
+
+    static struct option options[] = {
+        { "fifo",     required_argument, 0, 'd' },
+        { "socket",   required_argument, 0, 'S' },
+        { "control",  required_argument, 0, 'C' },
+        { "threads",  required_argument, 0, 't' },
+        { "channels", required_argument, 0, 'k' },
+        { "first",    required_argument, 0, 'f' },
+        { "rate",     required_argument, 0, 'r' },
+        { "seconds",  required_argument, 0, 's' },
+        { "window",   required_argument, 0, 'w' },
+        { "move",     required_argument, 0, 'm' },
+        { "stats",    required_argument, 0, 'T' },
+        { "help",     no_argument,       0, 'h' },
+        { 0,          0,                 0, 0   }
+    };
+    while ((c = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        if (c == 'd') {
+            path = optarg;
+            transport = PCA_CLIENT_FIFO;
+        } else if (c == 'S') {
+            path = optarg;
+            transport = PCA_CLIENT_SOCKET;
+        } else if (c == 'C') {
+            path = optarg;
+            transport = PCA_CLIENT_CONTROL;
+        } else if (c == 't') {
+            if ((numThreads = atoi(optarg)) < 1) usage();
+        } else if (c == 'k') {
+            if ((numChannels = atoi(optarg)) < 1) usage();
+        } else if (c == 'f') {
+            if ((firstServo = atoi(optarg)) < 0) usage();
+        } else if (c == 'r') {
+            if ((rate = atof(optarg)) <= 0) usage();
+        } else if (c == 's') {
+            if ((seconds = atof(optarg)) <= 0) usage();
+        } else if (c == 'w') {
+            if ((window = atol(optarg)) < 0) usage();
+        } else if (c == 'm') {
+            moveMSec = atoi(optarg);
+        } else if (c == 'T') {
+            statsPath = optarg;
+        } else {
+            usage();
+        }
+    }
+    if (optind != argc) usage();
+    // a daemon that goes away should be reported, not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((workers = calloc(numThreads, sizeof(*workers))) == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (i = 0; i < numThreads; i++) {
+        workers[i].index = i;
+        if ((workers[i].client = pca_client_open(path, transport)) == NULL) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        pca_client_set_window(workers[i].client, window);
+        pca_client_on_reply(workers[i].client, on_reply, &workers[i]);
+        // a batch a call at most, with --window=0
+        workers[i].maxSamples = (size_t)(rate / numThreads * seconds) + 1024;
+        if (workers[i].maxSamples > MAX_SAMPLES) workers[i].maxSamples = MAX_SAMPLES;
+        if ((workers[i].samples = malloc(workers[i].maxSamples * sizeof(uint64_t))) == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    printf("%d threads x %d channels over the %s for %.1f s, asking for %.0f settings/s\n",
+        numThreads, numChannels, transportNames[transport], seconds, rate);
+    startNSec = now_nsec();
+    endNSec = startNSec + (uint64_t)(seconds * 1e9);
+    for (i = 0; i < numThreads; i++) {
+        if ((errno = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < numThreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].error) {
+            fprintf(stderr, "thread %d: %s\n", i, strerror(workers[i].error));
+            failed = 1;
+        }
+        total.calls += workers[i].stats.calls;
+        total.replaced += workers[i].stats.replaced;
+        total.batches += workers[i].stats.batches;
+        total.bytes += workers[i].stats.bytes;
+        total.refused += workers[i].stats.refused;
+        lateTicks += workers[i].lateTicks;
+        numAll += workers[i].numSamples;
+    }
+    secs = (now_nsec() - startNSec) / 1e9;
+
+    printf("calls      %lu (%.0f/s)\n", total.calls, total.calls / secs);
+    printf("replaced   %lu in the batch before they were written\n", total.replaced);
+    printf("batches    %lu (%.0f/s), %lu bytes\n", total.batches, total.batches / secs, total.bytes);
+    printf("refused    %lu\n", total.refused);
+    printf("late ticks %lu\n", lateTicks);
+
+    if (numAll > 0 && (all = malloc(numAll * sizeof(uint64_t))) != NULL) {
+        uint64_t sum = 0;
+        size_t at = 0;
+        for (i = 0; i < numThreads; i++) {
+            memcpy(all + at, workers[i].samples, workers[i].numSamples * sizeof(uint64_t));
+            at += workers[i].numSamples;
+        }
+        qsort(all, numAll, sizeof(uint64_t), compare_u64);
+        for (at = 0; at < numAll; at++) sum += all[at];
+        printf("latency    mean %.0fus p50 %.0fus p99 %.0fus p99.9 %.0fus max %.0fus"
+            " (first call to answer, %zu batches)\n",
+            sum / 1e3 / numAll, all[numAll / 2] / 1e3, all[numAll * 99 / 100] / 1e3,
+            all[numAll * 999 / 1000] / 1e3, all[numAll - 1] / 1e3, numAll);
+        free(all);
+    } else if (transport == PCA_CLIENT_FIFO) {
+        printf("latency    not measured; a FIFO has no answers\n");
+    }
+    if (statsPath) daemon_stats(statsPath);
+    for (i = 0; i < numThreads; i++) pca_client_close(workers[i].client);
+    return failed;
+}
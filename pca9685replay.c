@@ -0,0 +1,332 @@
+/* pca9685replay - feed a log made with pca9685servod --record back to a daemon
+ *
+ * Text commands go to the daemon's FIFO, binary messages to its --socket and
+ * shared-memory updates into its --shm table, each at the time it was recorded,
+ * scaled by --speed, or as fast as the daemon takes them with --max. The daemon can
+ * be using any backend; replaying at --max against --backend=sim is a repeatable
+ * throughput benchmark. --dump prints the log instead, register writes included, so
+ * two runs can be compared with diff. A flight recorder dump is in the same format,
+ * so --dump reads those too.
+ *
+ * Released under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "pca9685_proto.h"
+#include "pca9685_shm.h"
+#include "pca9685_record.h"
+
+static const char *sourceNames[] = { "fifo", "control", "socket", "shm", "priority" };
+static const char *kindNames[] = { "ticks", "usec", "permyriad" };
+static const char *curveNames[] = { "linear", "in", "out", "inout" };
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: pca9685replay [OPTIONS] LOG\n"
+        "  --fifo=PATH     the daemon's command FIFO, default /dev/pca9685servo\n"
+        "  --priority=PATH the daemon's priority FIFO; without it those commands go\n"
+        "                  to --fifo\n"
+        "  --socket=PATH   the daemon's binary protocol socket, for recorded messages\n"
+        "  --shm=PATH      the daemon's shared-memory table, for recorded slot updates\n"
+        "  --speed=X       play back X times faster than recorded, default 1\n"
+        "  --max           play back as fast as the daemon will take it\n"
+        "  --loop=N        play the log N times over\n"
+        "  --dump          print the log, register writes included, rather than play it\n");
+    exit(1);
+}
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t nsec)
+{
+    struct timespec ts = { nsec / 1000000000ULL, nsec % 1000000000ULL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void dump_record(const struct pca_record *rec, const uint8_t *payload, uint64_t timeUSec)
+{
+    int i;
+
+    printf("%12.6f ", timeUSec / 1e6);
+    switch (rec->type) {
+    case PCA_REC_TEXT:
+        printf("%-8s %.*s\n", rec->source < 5 ? sourceNames[rec->source] : "?",
+            (int)rec->length, (const char *)payload);
+        break;
+    case PCA_REC_MESSAGE: {
+        struct pca_msg_header hdr;
+        struct pca_msg_item item;
+        if (rec->length < sizeof(hdr)) {
+            printf("socket   short message of %d bytes\n", rec->length);
+            break;
+        }
+        memcpy(&hdr, payload, sizeof(hdr));
+        printf("socket   seq %u:", hdr.seq);
+        for (i = 0; i < hdr.count && sizeof(hdr) + (i + 1) * sizeof(item) <= rec->length; i++) {
+            memcpy(&item, payload + sizeof(hdr) + i * sizeof(item), sizeof(item));
+            printf(" %u=%s%d %s", item.servo, item.flags & PCA_ITEM_RELATIVE ? "+" : "",
+                item.value, item.kind < 3 ? kindNames[item.kind] : "?");
+            if (item.durationMSec) printf("@%ums", item.durationMSec);
+        }
+        printf("\n");
+        break;
+    }
+    case PCA_REC_SHM: {
+        struct pca_record_shm shm;
+        memcpy(&shm, payload, sizeof(shm) <= rec->length ? sizeof(shm) : rec->length);
+        printf("shm      %u=%d %s", shm.servo, shm.value, shm.kind < 3 ? kindNames[shm.kind] : "?");
+        if (shm.durationMSec) printf("@%ums", shm.durationMSec);
+        printf("\n");
+        break;
+    }
+    case PCA_REC_WRITE:
+        if (rec->length < 2) {
+            printf("bus%-5d short write\n", rec->source);
+            break;
+        }
+        printf("bus%-5d 0x%02x reg 0x%02x:", rec->source, payload[0], payload[1]);
+        for (i = 2; i < rec->length; i++) printf(" %02x", payload[i]);
+        printf("\n");
+        break;
+    case PCA_REC_TARGET: {
+        struct pca_record_target target;
+        memset(&target, 0, sizeof(target));
+        memcpy(&target, payload, sizeof(target) <= rec->length ? sizeof(target) : rec->length);
+        printf("target   %u=%.2f%%", target.servo, target.width * 100.0 / 65536);
+        if (target.durationMSec) printf("@%ums:%s", target.durationMSec,
+            target.curve < 4 ? curveNames[target.curve] : "?");
+        printf("\n");
+        break;
+    }
+    case PCA_REC_WRITE_FAILED: {
+        struct pca_record_failure fail;
+        if (rec->length < sizeof(fail)) {
+            printf("bus%-5d short failed write\n", rec->source);
+            break;
+        }
+        memcpy(&fail, payload, sizeof(fail));
+        printf("bus%-5d 0x%02x reg 0x%02x FAILED (%s):", rec->source, fail.address, fail.reg,
+            strerror(-fail.result));
+        for (i = sizeof(fail); i < rec->length; i++) printf(" %02x", payload[i]);
+        printf("\n");
+        break;
+    }
+    default:
+        printf("unknown record type %d\n", rec->type);
+        break;
+    }
+}
+
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    const char *fifoPath = "/dev/pca9685servo", *priorityPath = NULL, *socketPath = NULL, *shmPath = NULL;
+    double speed = 1.0;
+    int dump = 0, loops = 1, loop, c, fd, sock = -1;
+    FILE *fifo = NULL, *priority = NULL;
+    struct pca_shm_table *shm = NULL;
+    const struct pca_record_file *file;
+    struct pca_record rec;
+    const uint8_t *log, *p, *end;
+    uint64_t startNSec, timeUSec, lastUSec, base;
+    unsigned long lines = 0, messages = 0, shmUpdates = 0, writes = 0, skipped = 0;
+    struct stat st;
+    double secs;
+
+    static struct option options[] = {
+        { "fifo",     required_argument, 0, 'd' },
+        { "priority", required_argument, 0, 'P' },
+        { "socket",   required_argument, 0, 'S' },
+        { "shm",      required_argument, 0, 'M' },
+        { "speed",    required_argument, 0, 's' },
+        { "max",      no_argument,       0, 'x' },
+        { "loop",     required_argument, 0, 'l' },
+        { "dump",     no_argument,       0, 'D' },
+        { "help",     no_argument,       0, 'h' },
+        { 0,          0,                 0, 0   }
+    };
+    while ((c = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        if (c == 'd') fifoPath = optarg;
+        else if (c == 'P') priorityPath = optarg;
+        else if (c == 'S') socketPath = optarg;
+        else if (c == 'M') shmPath = optarg;
+        else if (c == 's') {
+            if ((speed = atof(optarg)) <= 0) usage();
+        } else if (c == 'x') speed = 0;
+        else if (c == 'l') {
+            if ((loops = atoi(optarg)) < 1) usage();
+        } else if (c == 'D') dump = 1;
+        else usage();
+    }
+    if (optind != argc - 1) usage();
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(*file)
+            || (log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "%s: not a pca9685servod recording\n", argv[optind]);
+        return 1;
+    }
+    close(fd);
+    file = (const struct pca_record_file *)log;
+    if (file->magic != PCA_RECORD_MAGIC || file->version != PCA_RECORD_VERSION
+            || sizeof(*file) + file->numBoards * sizeof(struct pca_record_board) > (size_t)st.st_size) {
+        fprintf(stderr, "%s: not a pca9685servod recording, or from another version\n", argv[optind]);
+        return 1;
+    }
+    end = log + st.st_size;
+
+    if (dump) {
+        const struct pca_record_board *board = (const struct pca_record_board *)(file + 1);
+        for (c = 0; c < file->numBoards; c++) {
+            printf("# board %d: bus %d address 0x%02x cycle %uus\n", c, board[c].bus,
+                board[c].address, board[c].cycleTimeUSec);
+        }
+    } else {
+        if ((fifo = fopen(fifoPath, "w")) == NULL) {
+            perror(fifoPath);
+            return 1;
+        }
+        if (priorityPath && (priority = fopen(priorityPath, "w")) == NULL) {
+            perror(priorityPath);
+            return 1;
+        }
+        if (socketPath && (sock = open_socket(socketPath)) < 0) {
+            perror(socketPath);
+            return 1;
+        }
+        if (shmPath && (shm = pca_shm_open(shmPath)) == NULL) {
+            fprintf(stderr, "%s: can't open the shared-memory table\n", shmPath);
+            return 1;
+        }
+    }
+
+    startNSec = now_nsec();
+    for (loop = 0; loop < loops; loop++) {
+        uint64_t loopNSec = now_nsec();
+        p = log + sizeof(*file) + file->numBoards * sizeof(struct pca_record_board);
+        lastUSec = base = 0;
+        while (p + sizeof(rec) <= end) {
+            memcpy(&rec, p, sizeof(rec));
+            if (rec.type == PCA_REC_END || p + sizeof(rec) + rec.length > end) break;
+            p += sizeof(rec);
+
+            // the timestamps wrap every 71 minutes, and records from different
+            // threads can be a little out of order
+            timeUSec = base + rec.timeUSec;
+            if (timeUSec + (1ULL << 31) < lastUSec) {
+                base += 1ULL << 32;
+                timeUSec += 1ULL << 32;
+            }
+            if (timeUSec < lastUSec) timeUSec = lastUSec;
+            lastUSec = timeUSec;
+
+            if (dump) {
+                dump_record(&rec, p, timeUSec);
+                p += rec.length;
+                continue;
+            }
+            if (rec.type == PCA_REC_WRITE) {
+                writes++;
+                p += rec.length;
+                continue;
+            }
+            // what the daemon made of its inputs, which it will work out again
+            if (rec.type == PCA_REC_TARGET || rec.type == PCA_REC_WRITE_FAILED) {
+                p += rec.length;
+                continue;
+            }
+            if (speed > 0) {
+                uint64_t due = loopNSec + (uint64_t)(timeUSec * 1000.0 / speed);
+                if (due > now_nsec()) {
+                    fflush(fifo);
+                    sleep_until(due);
+                }
+            }
+            if (rec.type == PCA_REC_TEXT && rec.source == PCA_SRC_PRIORITY && priority) {
+                // it jumps the queue on the daemon's side, so don't hold it back here
+                fwrite(p, 1, rec.length, priority);
+                fputc('\n', priority);
+                fflush(priority);
+                lines++;
+            } else if (rec.type == PCA_REC_TEXT) {
+                fwrite(p, 1, rec.length, fifo);
+                fputc('\n', fifo);
+                lines++;
+            } else if (rec.type == PCA_REC_MESSAGE && sock >= 0) {
+                uint8_t buf[PCA_MSG_MAX_SIZE];
+                size_t len = rec.length < sizeof(buf) ? rec.length : sizeof(buf);
+                memcpy(buf, p, len);
+                // nobody is reading acks here
+                if (len >= sizeof(struct pca_msg_header))
+                    ((struct pca_msg_header *)buf)->flags &= ~PCA_FLAG_ACK;
+                // keep the order the daemon saw things in
+                fflush(fifo);
+                if (send(sock, buf, len, 0) < 0) {
+                    perror("send");
+                    return 1;
+                }
+                messages++;
+            } else if (rec.type == PCA_REC_SHM && shm && rec.length >= sizeof(struct pca_record_shm)) {
+                struct pca_record_shm slot;
+                memcpy(&slot, p, sizeof(slot));
+                if (slot.servo < shm->numSlots) {
+                    fflush(fifo);
+                    pca_shm_set(shm, slot.servo, slot.kind, slot.value, slot.durationMSec);
+                    shmUpdates++;
+                }
+            } else {
+                skipped++;
+            }
+            p += rec.length;
+        }
+    }
+    if (dump) return 0;
+    fflush(fifo);
+    secs = (now_nsec() - startNSec) / 1e9;
+
+    fprintf(stderr, "Replayed %lu command lines, %lu messages and %lu shm updates in %.3f s",
+        lines, messages, shmUpdates, secs);
+    if (secs > 0) fprintf(stderr, " (%.0f inputs/s)", (lines + messages + shmUpdates) / secs);
+    fprintf(stderr, "\n%lu register writes in the log", writes);
+    if (skipped) fprintf(stderr, "; %lu inputs skipped for want of --socket or --shm", skipped);
+    fprintf(stderr, "\n");
+    return 0;
+}
@@ -7,6 +7,7 @@
  * Released under the MIT license
  */
 
+#define _GNU_SOURCE     // for sched_setaffinity() and the CPU_SET macros
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,410 +24,3006 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "pca9685.h"
+#include "pca9685_backend.h"
+#include "pca9685_proto.h"
+#include "pca9685_shm.h"
+#include "pca9685_parse.h"
+#include "pca9685_record.h"
 
-#include <pigpiod_if2.h>
+// uncomment this next line if you want a lot of debug output
+// #define DEBUG 1
+
+#ifndef  DEBUG
+# define DEBUG	0
+#endif
+
+
+#if (DEBUG)
+void __sq_DPRINTF(const char *fmt, ...);
+# define DPRINTF(ARGS) __sq_DPRINTF ARGS
+#else
+# define DPRINTF(ARGS)	((void)0)
+#endif
+
+
+void 
+__sq_DPRINTF(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr,fmt, ap);
+  va_end(ap);
+}
+
+
+#define DEFAULT_cycleTimeUSec	1000000/50 // default to 50Hz -> 20,000uS
+#define MIN_cycleTimeUSec	655
+#define MAX_cycleTimeUSec	41666
+#define DEFAULT_stepTimeUSec	5 // gives 400 steps for typical servo range
+#define DEFAULT_servoMinPulseUSec	500 // Be aware that many cheap servos get very annoyed
+#define DEFAULT_servoMaxPulseUSec	2500// by getting pushed too far. Use the min/max
+                                    // options to change the limits
+
+#define PCADEVICEFILE			"/dev/pca9685servo"
+#define PCASTATEFILE			"/run/pca9685servod.state"
+#define PCAFLIGHTFILE			"/run/pca9685servod.flight"
+#define READ_CHUNK	4096	// bytes pulled from the FIFO per read()
+#define MAX_DRAIN_BYTES	65536	// most we read before sending what we have
+#define MAX_MOVE_MSEC	600000	// ten minutes is a very slow servo
+#define MAX_TXN_MSEC	10000	// a FIFO transaction open this long is abandoned
+#define MAX_CLIENTS	16	// binary socket connections at once
+#define MAX_CLIENT_MESSAGES	64	// most messages taken from one client per pass
+#define MAX_DISCARD_MESSAGES	1024	// most thrown away from one client by a stop
+#define BLOCK_WRITE_TRIES	3	// block writes failed in a row before using bytes
+#define BLOCK_RETRY_FLUSHES	1000	// byte-by-byte flushes before trying blocks again
+#define DEFAULT_RT_PRIORITY	50	// SCHED_FIFO priority for --realtime
+#define DEFAULT_LED_GAMMA	2.2	// brightness to duty cycle for LED channels
+#define WORKER_STACK_BYTES	(256 << 10)	// bus worker stacks under --realtime
+#define PREFAULT_STACK_BYTES	(64 << 10)	// stack touched up front by every thread
+#define CHANNELS_PER_BOARD	16
+#define MAX_BOARDS	16
+#define MAX_SERVOS	(MAX_BOARDS * CHANNELS_PER_BOARD)
+#define I2C_BUS 1
+#ifdef NO_PIGPIO
+#define DEFAULT_BACKEND "i2c-dev"
+#else
+#define DEFAULT_BACKEND "pigpio"
+#endif
+// Rewriting a few unchanged bytes to join two dirty runs is cheaper than paying for
+// another transaction (address, register byte and a round trip to the backend)
+#define MAX_BRIDGE_GAP 4
+// power-on broadcast addresses; see --broadcast
+#define ALLCALL_ADDRESS 0x70
+#define NUM_SUBADDRESSES 3
+// a dirty run plus its gap takes at least MAX_BRIDGE_GAP + 2 bytes of the LED range
+#define MAX_SPANS ((LED15_OFF_H - LED0_ON_L + 1) / (MAX_BRIDGE_GAP + 2) + 1)
+
+// which i2c backend to use for every bus
+static const char *backendSpec = DEFAULT_BACKEND;
+
+// default device address and bus, used when no --board options are given
+unsigned int i2c_address;
+static int i2c_bus = I2C_BUS;
+
+// the FIFO commands arrive on, and the optional socket for binary clients
+static const char *deviceFile = PCADEVICEFILE;
+// the optional priority FIFO, served ahead of everything else
+static const char *priorityFile = NULL;
+static const char *socketFile = NULL;
+// the optional text control socket
+static const char *controlFile = NULL;
+// and the optional shared-memory target table
+static const char *shmFile = NULL;
+static struct pca_shm_table *shmTable;
+// where the servo positions are kept for a warm restart, and whether to ignore them
+static const char *stateFile = PCASTATEFILE;
+static int coldStart;
+// --realtime: the SCHED_FIFO priority for every thread, or 0 for the normal
+// scheduler; and the CPUs to keep them all on, if --cpu is given
+static int realtimePriority;
+static const char *cpuList = NULL;
+static cpu_set_t cpuSet;
+// where the flight recorder goes after a crash, or NULL for nowhere
+static const char *flightFile = PCAFLIGHTFILE;
+// LED channels' brightness curve, from --gamma
+static double ledGamma = DEFAULT_LED_GAMMA;
+// and where to record what comes in and goes out, if anywhere
+static const char *recordFile = NULL;
+#define RECORD_MAX_BYTES (256u << 20)   // the file is sparse until it is written
+
+// Shadow copy of the PCA9685 register file. Everything we write goes through here
+// first, and only the bytes that actually differ from what the chip already holds
+// get marked dirty, so a repeated position costs no i2c traffic at all.
+struct pca_shadow {
+    uint8_t regs[256];
+    uint32_t dirty[256 / 32];   // one bit per register
+};
+
+// Latency histogram: count[i] holds samples under 2^i microseconds, and the last
+// bucket holds everything slower
+#define HIST_BUCKETS 24
+struct latency_hist {
+    unsigned long count[HIST_BUCKETS];
+    unsigned long samples;
+    uint64_t totalNSec;
+    uint64_t maxNSec;
+};
+
+struct pca_bus;
+
+// One PCA9685. Servo numbers are global: board * CHANNELS_PER_BOARD + channel, with
+// boards numbered in the order they were given on the command line.
+struct pca_board {
+    struct pca_bus *bus;
+    unsigned int address;
+    double cycleTimeUSec;       // the cycle time this board's prescale really gives
+    uint8_t prescale;           // timer setting byte for the PCA9685
+    uint8_t subBits;            // MODE1 SUBn bits for the subaddresses it answers to
+    struct pca_shadow shadow;   // belongs to the bus worker once it is running
+    // The mailbox the command thread leaves new LEDn register values in, one word
+    // per channel so each is stored and picked up whole, with a bit per channel in
+    // mailboxDirty. Both are only accessed atomically; a newer value simply
+    // replaces one the worker hasn't got to yet.
+    uint32_t mailbox[CHANNELS_PER_BOARD];
+    uint32_t mailboxDirty;
+    // filled in by the worker when asked to verify: what the chip's LED registers
+    // hold and what the shadow says they should, protected by bus->lock
+    int verifyStatus;           // 0, or -1 if the chip couldn't be read
+    uint8_t verifyRegs[CHANNELS_PER_BOARD * LED_MULTIPLYER];
+    uint8_t verifyShadow[CHANNELS_PER_BOARD * LED_MULTIPLYER];
+};
+
+// Each i2c bus gets its own backend connection and its own worker thread, so a
+// big update on one bus never waits behind traffic on another.
+struct pca_bus {
+    int number;
+    struct pca_backend i2c;
+    // With the MODE1 AI (auto-increment) flag set we can write all four LEDn registers
+    // for a channel in one i2c block write rather than four separate byte writes. Each
+    // pigpiod call is a round trip over the socket so this matters a lot. A failed
+    // block write is sent again byte by byte; only after BLOCK_WRITE_TRIES of them
+    // in a row do we drop back to the old byte-at-a-time path, and then block
+    // writes get another go every BLOCK_RETRY_FLUSHES flushes.
+    int useBlockWrites;
+    int blockFailures;          // block writes failed in a row
+    unsigned long byteFlushes;  // flushes sent byte by byte since dropping back
+    struct pca_board *boards[MAX_BOARDS];
+    int numBoards;
+    // With --broadcast, identical updates to every board on the bus go to the
+    // ALLCALL address, and to a group of whole boards to one of the SUBADRn
+    // addresses, as a single write to the ALL_LED registers
+    int broadcast;
+    int numSubgroups;
+    uint32_t subgroupBoards[NUM_SUBADDRESSES]; // bit i set for boards[i]
+    pthread_t worker;
+    // The worker sleeps on wakeFd, an eventfd. kicked is set once somebody has
+    // written to it and cleared by the worker as it wakes, so a burst of updates
+    // costs a single wake-up. Neither side ever waits for the other.
+    int wakeFd;
+    int kicked;
+    // odd while set_servos() is filling the mailboxes, so the worker can wait for a
+    // whole batch (such as a committed transaction) and send it in one flush
+    uint32_t posting;
+    uint32_t pendingSinceUSec;  // when the oldest update not yet picked up arrived,
+                                // in wrapping microseconds; 0 for none
+    uint32_t frameDueUSec;      // likewise the frame boundary it belongs to, if any
+    int verifyRequested;        // read the chips back after the next flush
+    // lock protects the rest, which the command thread only looks at for queries
+    pthread_mutex_t lock;
+    int verifyDone;
+    pthread_cond_t verified;
+    // counters kept by the worker; the backend has the rest
+    unsigned long updates;      // flushes that sent something
+    unsigned long writeFailures; // flushes that left registers unsent
+    unsigned long boardFailures; // boards those left behind, counted once a flush
+    struct latency_hist latency; // input arriving to its flush finishing
+    struct latency_hist flushTime; // time spent sending each flush
+    struct latency_hist jitter; // frame boundary to its flush being issued
+};
+
+static struct pca_board boards[MAX_BOARDS];
+static int numBoards;
+static struct pca_bus buses[MAX_BOARDS];
+static int numBuses;
+static int numServos;           // numBoards * CHANNELS_PER_BOARD
+
+// Why commands get rejected, for the stats
+enum { REJECT_SYNTAX, REJECT_SERVO, REJECT_WIDTH, REJECT_DURATION, REJECT_TOO_LONG,
+    REJECT_CALIBRATION, REJECT_MESSAGE, REJECT_SHM, REJECT_TRANSACTION, NUM_REJECTS };
+static const char *rejectNames[NUM_REJECTS] = { "syntax", "servo", "width", "duration",
+    "too_long", "calibration", "message", "shm", "transaction" };
+
+// counters for the command side, only touched by the main thread
+static struct {
+    unsigned long commands;     // text command lines, from any source
+    unsigned long assignments;  // servo targets those set
+    unsigned long messages;     // binary protocol messages
+    unsigned long items;        // binary protocol items
+    unsigned long shmUpdates;   // shared-memory slots picked up
+    unsigned long frames;       // motion/sampling frames
+    unsigned long missedFrames; // ticks that went by unhandled
+    unsigned long coalesced;    // targets replaced before they were sent
+    unsigned long commits;      // transactions committed
+    unsigned long aborts;       // transactions aborted, or dropped when left open
+    unsigned long stops;        // stop and park commands
+    unsigned long discarded;    // input bytes or messages thrown away by a priority stop
+    unsigned long rejected[NUM_REJECTS];
+} stats;
+
+// The frame timer runs on absolute deadlines, so the nominal time of each tick, the
+// frame boundary, is known and the updates it leads to can be timed against it
+static uint64_t frameNextNSec;          // the next tick
+static uint64_t framePeriodNSec;
+static uint64_t frameDueNSec;           // boundary of the frame being handled, else 0
+static struct latency_hist frameWake;   // boundary to the command thread handling it
+
+// Named groups of servos, usable wherever a servo number is
+#define MAX_GROUPS 32
+#define MAX_GROUP_NAME 32
+struct servo_group {
+    char name[MAX_GROUP_NAME];
+    uint8_t member[MAX_SERVOS];
+};
+static struct servo_group groups[MAX_GROUPS];
+static int numGroups;
+static int broadcastEnabled;
+
+static const int subAddresses[NUM_SUBADDRESSES] = { 0x71, 0x72, 0x74 };
+static const uint8_t subRegs[NUM_SUBADDRESSES] = { SUBADR1, SUBADR2, SUBADR3 };
+static const uint8_t subModeBits[NUM_SUBADDRESSES] = { SUB1, SUB2, SUB3 };
+
+// cycleTimeUSec is the pulse cycle time per servo, in microseconds.
+// Typically it should be 20ms for a 50Hz frame; it gets adjusted to match the
+// actual value achieved by the PCA9685. It is the default for every board; a board
+// can be given its own with --board.
+// stepTimeUSec is the pulse width increment granularity, again in microseconds.
+
+static double cycleTimeUSec;
+static double stepTimeUSec;
+static int32_t stepNSec;        // the same, for the fixed point conversions
+
+static int servoStart[MAX_SERVOS];
+// servoWidth[] is each servo's position as a 16.16 fixed point fraction of its
+// calibrated range, so turning it into register values needs no floating point
+#define WIDTH_SHIFT 16
+#define WIDTH_ONE (1 << WIDTH_SHIFT)
+// It normally points into the state file (see commit_state()), so the positions are
+// always saved without any extra work.
+static int32_t unsavedWidth[MAX_SERVOS];
+static int32_t *servoWidth = unsavedWidth;
+// likewise which channels have been driven, for a warm restart to leave the rest off
+static uint8_t unsavedSent[MAX_SERVOS];
+static uint8_t *servoSent = unsavedSent;
+// servoMinPulseUSec and servoMaxPulseUSec are the defaults for every channel's range
+static double servoMinPulseUSec, servoMaxPulseUSec;
+
+// Per-channel calibration. Widths are fractions of min..max; invert mirrors them
+// within that range and trim then shifts the pulse actually sent. An LED channel
+// ignores the range: its width is the fraction of the whole cycle it is on for.
+struct servo_cal {
+	double minUSec, maxUSec;
+	double trimUSec;
+	int invert;
+	double parkUSec;            // where "park" sends it; negative for mid range
+	int led;
+};
+static struct servo_cal servoCal[MAX_SERVOS];
+static const char *calibrationFile = NULL;
+
+// Each channel's calibration and its board's cycle time compiled down to a straight
+// line from servoWidth to pulse length in 16.16 fixed point PWM ticks, and the
+// factor for turning times into ticks. Rebuilt by build_channel_map() whenever
+// either changes, so commands are turned into widths and registers without any
+// floating point.
+struct channel_map {
+	int32_t baseTicks;          // pulse length at width 0
+	int32_t spanTicks;          // change in pulse length from width 0 to 1
+	int64_t nsecScale;          // 16.16 ticks per nanosecond, times 2^32
+	int32_t cycleNSec;
+	int led;                    // use the full on and full off bits at the ends
+};
+static struct channel_map channelMap[MAX_SERVOS];
+	
+static void terminate(int sig)
+{
+	int i;
+
+	// a crash, as opposed to being asked to stop, leaves the flight recorder behind
+	if (flightFile && (sig == SIGSEGV || sig == SIGBUS || sig == SIGILL || sig == SIGFPE
+			|| sig == SIGABRT || sig == SIGSYS || sig == SIGQUIT)) {
+		pca_flight_dump(flightFile);
+	}
+
+    /* disconnect from the i2c backends and release the file descriptors */
+	unlink(deviceFile);
+	if (priorityFile) unlink(priorityFile);
+	if (socketFile) unlink(socketFile);
+	if (shmFile) unlink(shmFile);
+	if (controlFile) unlink(controlFile);
+	pca_record_close();
+	for (i = 0; i < numBuses; i++) {
+		pca_backend_close(&buses[i].i2c);
+	}
+	exit(1);
+}
+
+static void fatal(char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (flightFile) pca_flight_dump(flightFile);
+	terminate(0);
+}
+
+// read a run of registers with as few block reads as the backend allows
+static int read_regs(struct pca_board *board, int reg, uint8_t *buf, int count)
+{
+    struct pca_backend *be = &board->bus->i2c;
+    int n;
+
+    while (count > 0) {
+        n = count < be->maxBlock ? count : be->maxBlock;
+        if (pca_read_block(be, board->address, reg, buf, n) != n) return -1;
+        reg += n;
+        buf += n;
+        count -= n;
+    }
+    return 0;
+}
+
+#if (DEBUG)
+// read the pwm parameters for a channel and return the raw 12 bit unsigned values
+// (plus the full on/off bit 0x1000) in one block read
+static int read_servo(struct pca_board *board, int channel, unsigned int *on, unsigned int *off) {
+    uint8_t on_off[LED_MULTIPLYER];
+
+    if (read_regs(board, LED0_ON_L + LED_MULTIPLYER * channel, on_off, LED_MULTIPLYER) < 0) {
+        DPRINTF(("Bad i2c block read for channel: %d\n", channel));
+        return -1;
+    }
+    *on = on_off[0] | (on_off[1] <<8);
+    *off = on_off[2] | (on_off[3] <<8);
+    return 0;
+}
+#endif
+
+static int shadow_is_dirty(struct pca_shadow *shadow, int reg)
+{
+    return (shadow->dirty[reg >> 5] >> (reg & 31)) & 1;
+}
+
+static void shadow_mark(struct pca_shadow *shadow, int reg, int dirty)
+{
+    if (dirty) {
+        shadow->dirty[reg >> 5] |= 1u << (reg & 31);
+    } else {
+        shadow->dirty[reg >> 5] &= ~(1u << (reg & 31));
+    }
+}
+
+// stage a register value; it only becomes dirty if it differs from the chip
+static void shadow_set(struct pca_shadow *shadow, int reg, uint8_t value)
+{
+    if (shadow->regs[reg] != value) {
+        shadow->regs[reg] = value;
+        shadow_mark(shadow, reg, 1);
+    }
+}
+
+// write a single register straight away, keeping the shadow in step
+static int write_reg(struct pca_board *board, int reg, uint8_t value)
+{
+    int ret = pca_write_byte(&board->bus->i2c, board->address, reg, value);
+    if (ret >= 0) {
+        board->shadow.regs[reg] = value;
+        shadow_mark(&board->shadow, reg, 0);
+    }
+    return ret;
+}
+
+static void  all_pwm_off(struct pca_board *board)
+{
+    int reg;
+    // turn off all pwm outputs
+    write_reg(board, ALLLED_ON_L, 0);
+    write_reg(board, ALLLED_ON_H, 0);
+    write_reg(board, ALLLED_OFF_L, 0);
+    write_reg(board, ALLLED_OFF_H, 0);
+    // the ALL_LED registers load every LEDn register, so the shadow now knows them all
+    for (reg = LED0_ON_L; reg <= LED15_OFF_H; reg++) {
+        board->shadow.regs[reg] = 0;
+        shadow_mark(&board->shadow, reg, 0);
+    }
+}
+
+// work out the four LEDn register bytes for a servo from its current servoWidth
+static void servo_registers(int servo, uint8_t *on_off)
+{
+    const struct channel_map *map = &channelMap[servo];
+    int onValue, offValue, ticks;
+    // set this servo to start at the servoStart tick and stay on for width ticks
+    onValue = servoStart[servo];
+    ticks = (map->baseTicks + (int32_t)((int64_t)map->spanTicks * servoWidth[servo] / WIDTH_ONE))
+            >> WIDTH_SHIFT;
+    offValue = (onValue + ticks) % 4096;
+    // an LED that is fully off or fully on has no edges, and the chip has bits for that
+    if (map->led && ticks <= 0) {
+        onValue = 0;
+        offValue = LED_FULL << 8;
+    } else if (map->led && ticks >= 4096) {
+        onValue = LED_FULL << 8;
+        offValue = 0;
+    }
+    DPRINTF(( "servo: %d on: %d off: %d\n", servo, onValue, offValue));
+    on_off[0] = onValue & 0xFF;   
+    on_off[1] = onValue >> 8;   
+    on_off[2] = offValue & 0xFF;   
+    on_off[3] = offValue >> 8;   
+}
+
+static uint64_t monotonic_nsec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// find the board a span of registers belongs to so its shadow can be updated
+static struct pca_board *span_board(struct pca_bus *bus, const struct pca_xfer *span)
+{
+    int i;
+    for (i = 0; i < bus->numBoards; i++) {
+        if (bus->boards[i]->address == span->addr) return bus->boards[i];
+    }
+    return NULL;
+}
+
+// the shadow registers a span loaded are on the chips now
+static void spans_sent(struct pca_bus *bus, const struct pca_xfer *spans, const uint32_t *covers, int numSpans)
+{
+    struct pca_board *board;
+    int i, b, reg;
+
+    for (i = 0; i < numSpans; i++) {
+        for (b = 0; covers[i] && b < bus->numBoards; b++) {
+            if (!(covers[i] & (1u << b))) continue;
+            for (reg = LED0_ON_L; reg <= LED15_OFF_H; reg++) {
+                shadow_mark(&bus->boards[b]->shadow, reg, 0);
+            }
+        }
+        if (covers[i]) continue;
+        board = span_board(bus, &spans[i]);
+        for (reg = spans[i].reg; reg < spans[i].reg + spans[i].count; reg++) {
+            shadow_mark(&board->shadow, reg, 0);
+        }
+    }
+}
+
+static void count_board_failures(struct pca_bus *bus, int failed)
+{
+    pthread_mutex_lock(&bus->lock);
+    bus->boardFailures += failed;
+    pthread_mutex_unlock(&bus->lock);
+}
+
+// send a batch of shadow register spans to the chips on a bus. With AI set the
+// LED0_ON_L..LED15_OFF_H range is contiguous, so each span is a single block write,
+// and backends that can will send the whole batch as one transaction. covers[i] is
+// zero for an ordinary span, or marks the boards (by index in bus->boards) whose
+// LED registers a broadcast span loads entirely. Anything that fails to reach the
+// chip is left dirty so the next flush tries again. One board that stops answering
+// mustn't hold up the rest of the bus, so if the batch fails each board's spans
+// are sent again on their own and only the ones that fail are left behind.
+static int write_shadow_spans(struct pca_bus *bus, struct pca_xfer *spans, const uint32_t *covers, int numSpans)
+{
+    struct pca_board *board;
+    int i, n, b, reg, ret, sent = 0, failed = 0;
+
+    if (!bus->useBlockWrites && ++bus->byteFlushes >= BLOCK_RETRY_FLUSHES) {
+        // whatever broke them may have passed; one more failure drops back again
+        bus->useBlockWrites = 1;
+        bus->blockFailures = BLOCK_WRITE_TRIES - 1;
+    }
+    if (bus->useBlockWrites) {
+        ret = pca_write_multi(&bus->i2c, spans, numSpans);
+        if (ret >= 0) {
+            bus->blockFailures = 0;
+            spans_sent(bus, spans, covers, numSpans);
+            return 0;
+        }
+        // flush_bus keeps a board's spans together, and a broadcast span stands alone
+        for (i = 0; i < numSpans && spans[0].addr != spans[numSpans - 1].addr; i += n) {
+            for (n = 1; !covers[i] && i + n < numSpans && !covers[i + n]
+                    && spans[i + n].addr == spans[i].addr; n++)
+                ;
+            if (pca_write_multi(&bus->i2c, &spans[i], n) >= 0) {
+                spans_sent(bus, &spans[i], &covers[i], n);
+                sent++;
+            } else {
+                DPRINTF(("Bad i2c block write to 0x%02x on bus %d\n", spans[i].addr, bus->number));
+                failed += covers[i] ? __builtin_popcount(covers[i]) : 1;
+            }
+        }
+        if (sent) {
+            // block writes work, it's the boards that failed that are the trouble
+            bus->blockFailures = 0;
+            count_board_failures(bus, failed);
+            return -1;
+        }
+        // a glitch shouldn't cost the bus its block writes, so send this flush
+        // byte by byte and only give up on them if it keeps happening
+        if (++bus->blockFailures >= BLOCK_WRITE_TRIES) {
+            fprintf(stderr, "i2c block writes failed %d times running on bus %d (%d); falling back to byte writes\n",
+                bus->blockFailures, bus->number, ret);
+            bus->useBlockWrites = 0;
+            bus->byteFlushes = 0;
+        }
+        failed = 0;
+    }
+    // only the bytes that really changed need sending one at a time; a board that
+    // fails one is left for the next flush and the rest still get theirs
+    for (b = 0; b < bus->numBoards; b++) {
+        board = bus->boards[b];
+        for (reg = LED0_ON_L; reg <= LED15_OFF_H; reg++) {
+            if (shadow_is_dirty(&board->shadow, reg) && write_reg(board, reg, board->shadow.regs[reg]) < 0) {
+                DPRINTF(("Bad i2c byte write for register: 0x%02x on board 0x%02x\n", reg, board->address));
+                failed++;
+                break;
+            }
+        }
+    }
+    if (failed) {
+        count_board_failures(bus, failed);
+        return -1;
+    }
+    return 0;
+}
+
+// how many of a board's channels have dirty registers, or -1 if its channels
+// don't all hold the same values and so can't be loaded through ALL_LED
+static int uniform_channels(struct pca_board *board)
+{
+    const uint8_t *regs = &board->shadow.regs[LED0_ON_L];
+    int channel, reg, dirty = 0, isDirty;
+
+    for (channel = 0; channel < CHANNELS_PER_BOARD; channel++) {
+        isDirty = 0;
+        for (reg = 0; reg < LED_MULTIPLYER; reg++) {
+            if (regs[LED_MULTIPLYER * channel + reg] != regs[reg]) return -1;
+            isDirty |= shadow_is_dirty(&board->shadow, LED0_ON_L + LED_MULTIPLYER * channel + reg);
+        }
+        dirty += isDirty;
+    }
+    return dirty;
+}
+
+// can every board in the mask be loaded with one ALL_LED write? They must all be
+// uniform with the same values, and it is only worth it if two channels changed
+static int broadcast_ok(struct pca_bus *bus, uint32_t mask, const int *dirty)
+{
+    const uint8_t *first = NULL;
+    int b, changed = 0;
+
+    for (b = 0; b < bus->numBoards; b++) {
+        if (!(mask & (1u << b))) continue;
+        if (dirty[b] < 0) return 0;
+        if (!first) first = &bus->boards[b]->shadow.regs[LED0_ON_L];
+        else if (memcmp(first, &bus->boards[b]->shadow.regs[LED0_ON_L], LED_MULTIPLYER)) return 0;
+        changed += dirty[b];
+    }
+    return first && changed >= 2;
+}
+
+// send every dirty LED register on a bus using as few writes as possible. Boards
+// whose channels all come out the same are loaded through ALL_LED, through the
+// ALLCALL or a subaddress when that covers several at once. Otherwise a run of
+// dirty bytes is extended over short clean gaps as long as it still fits in one
+// block write; if nothing changed nothing is sent. Returns the number of spans
+// written, or -1 if some of them didn't make it.
+static int flush_bus(struct pca_bus *bus)
+{
+    struct pca_xfer spans[MAX_SPANS * MAX_BOARDS];
+    uint32_t covers[MAX_SPANS * MAX_BOARDS];
+    int dirty[MAX_BOARDS];
+    uint32_t all = (1u << bus->numBoards) - 1, done = 0, mask;
+    struct pca_board *board;
+    int numSpans = 0;
+    int i, b, reg, last, gap, address;
+#if (DEBUG)
+    unsigned long startTransactions = bus->i2c.transactions;
+#endif
+
+    for (b = 0; b < bus->numBoards; b++) {
+        dirty[b] = uniform_channels(bus->boards[b]);
+    }
+    for (i = -1; i < NUM_SUBADDRESSES + bus->numBoards; i++) {
+        // first everything via ALLCALL, then the subgroups, then single boards
+        if (i < 0) {
+            if (!bus->broadcast) continue;
+            mask = all;
+            address = ALLCALL_ADDRESS;
+        } else if (i < NUM_SUBADDRESSES) {
+            if (i >= bus->numSubgroups) continue;
+            mask = bus->subgroupBoards[i];
+            address = subAddresses[i];
+        } else {
+            b = i - NUM_SUBADDRESSES;
+            mask = 1u << b;
+            address = bus->boards[b]->address;
+        }
+        if ((mask & done) || !broadcast_ok(bus, mask, dirty)) continue;
+        for (b = 0; !(mask & (1u << b)); b++)
+            ;
+        spans[numSpans].addr = address;
+        spans[numSpans].reg = ALLLED_ON_L;
+        spans[numSpans].buf = &bus->boards[b]->shadow.regs[LED0_ON_L];
+        spans[numSpans].count = LED_MULTIPLYER;
+        covers[numSpans++] = mask;
+        done |= mask;
+    }
+
+    for (b = 0; b < bus->numBoards; b++) {
+        if (done & (1u << b)) continue;
+        board = bus->boards[b];
+        reg = LED0_ON_L;
+        while (reg <= LED15_OFF_H) {
+            if (!shadow_is_dirty(&board->shadow, reg)) {
+                reg++;
+                continue;
+            }
+            last = reg;
+            gap = 0;
+            while (last + gap + 1 <= LED15_OFF_H && last + gap + 1 - reg < bus->i2c.maxBlock) {
+                if (shadow_is_dirty(&board->shadow, last + gap + 1)) {
+                    last += gap + 1;
+                    gap = 0;
+                } else if (++gap > MAX_BRIDGE_GAP) {
+                    break;
+                }
+            }
+            spans[numSpans].addr = board->address;
+            spans[numSpans].reg = reg;
+            spans[numSpans].buf = &board->shadow.regs[reg];
+            spans[numSpans].count = last - reg + 1;
+            covers[numSpans++] = 0;
+            reg = last + 1;
+        }
+    }
+    if (numSpans == 0) return 0;
+    if (write_shadow_spans(bus, spans, covers, numSpans) < 0) return -1;
+    DPRINTF(("bus %d update used %lu i2c transactions (%lu in total)\n", bus->number,
+        bus->i2c.transactions - startTransactions, bus->i2c.transactions));
+
+#if (DEBUG)
+    for (i = 0; i < bus->numBoards; i++) {
+        unsigned int on_val, off_val;
+        for (reg = 0; reg < CHANNELS_PER_BOARD; reg++) {
+            if (read_servo(bus->boards[i], reg, &on_val, &off_val) < 0) continue;
+            DPRINTF(("PCA 0x%02x channel %d registered on = %u off= %u\n",
+                bus->boards[i]->address, reg, on_val, off_val));
+        }
+    }
+#endif
+    return numSpans;
+}
+
+static void hist_add(struct latency_hist *hist, uint64_t nsec)
+{
+    uint64_t usec = nsec / 1000;
+    int bucket = 0;
+
+    while (bucket < HIST_BUCKETS - 1 && usec >= (1ULL << bucket)) bucket++;
+    hist->count[bucket]++;
+    hist->samples++;
+    hist->totalNSec += nsec;
+    if (nsec > hist->maxNSec) hist->maxNSec = nsec;
+}
+
+// read back every board's LED registers for comparison with the shadows. Only the
+// worker may touch the bus, so the command thread asks for this and waits.
+static void verify_bus(struct pca_bus *bus)
+{
+    struct pca_board *board;
+    uint8_t regs[CHANNELS_PER_BOARD * LED_MULTIPLYER];
+    int i, ret;
+
+    for (i = 0; i < bus->numBoards; i++) {
+        board = bus->boards[i];
+        ret = read_regs(board, LED0_ON_L, regs, sizeof(regs));
+        pthread_mutex_lock(&bus->lock);
+        board->verifyStatus = ret;
+        memcpy(board->verifyRegs, regs, sizeof(regs));
+        memcpy(board->verifyShadow, &board->shadow.regs[LED0_ON_L], sizeof(regs));
+        pthread_mutex_unlock(&bus->lock);
+    }
+    __atomic_store_n(&bus->verifyRequested, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&bus->lock);
+    bus->verifyDone = 1;
+    pthread_cond_broadcast(&bus->verified);
+    pthread_mutex_unlock(&bus->lock);
+}
+
+// touch the stack a thread will use, so a deep call later doesn't stop to fault
+// a page in; under --realtime the pages then stay locked
+static void prefault_stack(void)
+{
+    volatile char buf[PREFAULT_STACK_BYTES];
+    size_t i;
+
+    for (i = 0; i < sizeof(buf); i += 4096) buf[i] = 0;
+}
+
+static void kick_worker(struct pca_bus *bus)
+{
+    uint64_t one = 1;
+    if (!__atomic_exchange_n(&bus->kicked, 1, __ATOMIC_SEQ_CST)) {
+        if (write(bus->wakeFd, &one, sizeof(one)) != sizeof(one)) {
+            DPRINTF(("Failed to wake the worker for bus %d\n", bus->number));
+        }
+    }
+}
+
+// The worker for one bus: pick up whatever register values the command thread has
+// left in the mailboxes, fold them into the shadows and flush. Values that arrive
+// while a flush is in progress simply replace older ones, so the bus always sends
+// the newest positions and a slow bus never builds up a backlog.
+static void *bus_worker(void *arg)
+{
+    struct pca_bus *bus = arg;
+    struct pca_board *board;
+    uint64_t count, startNSec, endNSec;
+    uint32_t sinceUSec, dueUSec, taken, mask, word, posting;
+    int i, channel, reg, ret;
+
+    if (realtimePriority) prefault_stack();
+    for (;;) {
+        if (read(bus->wakeFd, &count, sizeof(count)) != sizeof(count)) continue;
+        // clear kicked before looking in the mailboxes so that anything posted
+        // after this point kicks us again
+        __atomic_store_n(&bus->kicked, 0, __ATOMIC_SEQ_CST);
+        sinceUSec = dueUSec = 0;
+        // Keep picking up until no batch was being posted while we looked, so a
+        // batch is never split across two flushes. Posting is a few microseconds
+        // of arithmetic on the command thread, so the wait is short.
+        do {
+            while ((posting = __atomic_load_n(&bus->posting, __ATOMIC_SEQ_CST)) & 1) {
+                sched_yield();
+            }
+            // the timestamps go before the masks: set_servos() sets them before it
+            // publishes a mask, so a mask we take has its arrival time with it, or
+            // posting has moved and we go round again. The first one is the oldest.
+            taken = __atomic_exchange_n(&bus->pendingSinceUSec, 0, __ATOMIC_SEQ_CST);
+            if (!sinceUSec) sinceUSec = taken;
+            taken = __atomic_exchange_n(&bus->frameDueUSec, 0, __ATOMIC_SEQ_CST);
+            if (!dueUSec) dueUSec = taken;
+            for (i = 0; i < bus->numBoards; i++) {
+                board = bus->boards[i];
+                mask = __atomic_exchange_n(&board->mailboxDirty, 0, __ATOMIC_SEQ_CST);
+                for (channel = 0; mask; channel++) {
+                    if (!(mask & (1u << channel))) continue;
+                    mask &= ~(1u << channel);
+                    word = __atomic_load_n(&board->mailbox[channel], __ATOMIC_RELAXED);
+                    for (reg = 0; reg < LED_MULTIPLYER; reg++) {
+                        shadow_set(&board->shadow, LED0_ON_L + LED_MULTIPLYER * channel + reg,
+                            (uint8_t)(word >> (8 * reg)));
+                    }
+                }
+            }
+        } while (__atomic_load_n(&bus->posting, __ATOMIC_SEQ_CST) != posting);
+
+        startNSec = monotonic_nsec();
+        ret = flush_bus(bus);
+        endNSec = monotonic_nsec();
+        pthread_mutex_lock(&bus->lock);
+        if (ret < 0) {
+            bus->writeFailures++;
+        } else if (ret > 0) {
+            bus->updates++;
+            if (sinceUSec) {
+                hist_add(&bus->latency, (uint64_t)(uint32_t)(endNSec / 1000 - sinceUSec) * 1000);
+            }
+            hist_add(&bus->flushTime, endNSec - startNSec);
+            if (dueUSec) {
+                hist_add(&bus->jitter, (uint64_t)(uint32_t)(startNSec / 1000 - dueUSec) * 1000);
+            }
+        }
+        pthread_mutex_unlock(&bus->lock);
+
+        if (__atomic_load_n(&bus->verifyRequested, __ATOMIC_ACQUIRE)) {
+            verify_bus(bus);
+        }
+    }
+    return NULL;
+}
+
+// The workers inherit the main thread's scheduling policy and CPUs. Under
+// --realtime their stacks are kept small, since all of a stack gets locked into RAM.
+static void start_workers(void)
+{
+    pthread_attr_t attr;
+    sigset_t all, old;
+    int i;
+
+    pthread_attr_init(&attr);
+    if (realtimePriority) pthread_attr_setstacksize(&attr, WORKER_STACK_BYTES);
+    // leave signal handling to the main thread, apart from the faults a worker
+    // causes itself, which have to be handled there or not at all
+    sigfillset(&all);
+    sigdelset(&all, SIGSEGV);
+    sigdelset(&all, SIGBUS);
+    sigdelset(&all, SIGILL);
+    sigdelset(&all, SIGFPE);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < numBuses; i++) {
+        if (pthread_create(&buses[i].worker, &attr, bus_worker, &buses[i]) != 0)
+            fatal("pca9685servod: Failed to start the worker for bus %d\n", buses[i].number);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+// hand the new register values for every servo flagged in changed[] to the bus
+// workers. Only register bytes that differ from the shadow copy get written, so
+// resending the current position is free. sinceNSec is when the update arrived,
+// for the latency stats. Each call's changes on a bus go out in a single flush, and
+// it never waits on a worker, however busy its bus is.
+static void set_servos(const int *changed, uint64_t sinceNSec)
+{
+    struct pca_board *board;
+    struct pca_bus *bus;
+    uint8_t on_off[LED_MULTIPLYER];
+    uint32_t expected, sinceUSec, dueUSec;
+    int servo, b, channel, any;
+
+    sinceUSec = (uint32_t)(sinceNSec / 1000);
+    if (!sinceUSec) sinceUSec = 1;
+    dueUSec = (uint32_t)(frameDueNSec / 1000);
+    if (frameDueNSec && !dueUSec) dueUSec = 1;
+    for (b = 0; b < numBuses; b++) {
+        bus = &buses[b];
+        any = 0;
+        __atomic_fetch_add(&bus->posting, 1, __ATOMIC_SEQ_CST);
+        for (servo = 0; servo < numServos; servo++) {
+            board = &boards[servo / CHANNELS_PER_BOARD];
+            if (!changed[servo] || board->bus != bus) continue;
+            channel = servo % CHANNELS_PER_BOARD;
+            servoSent[servo] = 1;
+            // stamp the bus before its first mask goes up, from 0 so an update the
+            // worker hasn't picked up yet keeps its older time
+            if (!any) {
+                expected = 0;
+                __atomic_compare_exchange_n(&bus->pendingSinceUSec, &expected, sinceUSec, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                expected = 0;
+                if (dueUSec) {
+                    __atomic_compare_exchange_n(&bus->frameDueUSec, &expected, dueUSec, 0,
+                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                }
+            }
+            servo_registers(servo, on_off);
+            __atomic_store_n(&board->mailbox[channel],
+                on_off[0] | (on_off[1] << 8) | (on_off[2] << 16) | ((uint32_t)on_off[3] << 24),
+                __ATOMIC_RELAXED);
+            __atomic_fetch_or(&board->mailboxDirty, 1u << channel, __ATOMIC_SEQ_CST);
+            any = 1;
+        }
+        __atomic_fetch_add(&bus->posting, 1, __ATOMIC_SEQ_CST);
+        if (any) kick_worker(bus);
+    }
+}
+
+static void setup_sighandlers(void)
+{
+	static char altStack[64 << 10];
+	stack_t ss;
+	int i;
+
+	// so that running out of stack still gets the flight recorder written
+	memset(&ss, 0, sizeof(ss));
+	ss.ss_sp = altStack;
+	ss.ss_size = sizeof(altStack);
+	sigaltstack(&ss, NULL);
+
+	// Catch all signals possible
+	for (i = 0; i < 64; i++) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = terminate;
+		sa.sa_flags = SA_ONSTACK;
+		sigaction(i, &sa, NULL);
+	}
+}
+
+
+static void init_servo_starts(int spreadout) {
+    int servo, currentStart = 0;
+	/* set the servo start ticks either at the same time (spreadout = 0) or
+	to spread out the current draw . The former mighth help when driving LEDs */
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		servoStart[servo] = currentStart;
+		if (spreadout) currentStart = (currentStart + 4096 / CHANNELS_PER_BOARD) % 4096;
+	}
+}
+
+// compile a channel's calibration into its channelMap entry
+static void build_channel_map(int servo) {
+	const struct servo_cal *cal = &servoCal[servo];
+	// 16.16 ticks per microsecond on this servo's board
+	double scale = 4096.0 * WIDTH_ONE / boards[servo / CHANNELS_PER_BOARD].cycleTimeUSec;
+	struct channel_map *map = &channelMap[servo];
+
+	map->baseTicks = (int32_t)lround((cal->minUSec + cal->trimUSec) * scale);
+	map->spanTicks = (int32_t)lround((cal->maxUSec - cal->minUSec) * scale);
+	map->nsecScale = llround(scale / 1000.0 * 4294967296.0);
+	map->cycleNSec = (int32_t)lround(boards[servo / CHANNELS_PER_BOARD].cycleTimeUSec * 1000.0);
+	map->led = cal->led;
+	if (cal->led) {
+		// the whole cycle, which keeps the conversion exact
+		map->baseTicks = 0;
+		map->spanTicks = 4096 << WIDTH_SHIFT;
+	}
+	if (cal->invert) {
+		map->baseTicks += map->spanTicks;
+		map->spanTicks = -map->spanTicks;
+	}
+}
+
+// the pulse length a width sends, in 16.16 ticks
+static int64_t width_ticks(int servo, int32_t width) {
+	const struct channel_map *map = &channelMap[servo];
+	return map->baseTicks + (int64_t)map->spanTicks * width / WIDTH_ONE;
+}
+
+// and back: the width that sends a pulse of ticks, or -1 if that is outside the
+// servo's range. Trim and inversion are in the map, so this undoes them.
+static int32_t ticks_width(int servo, int64_t ticks) {
+	const struct channel_map *map = &channelMap[servo];
+	int64_t width = ((ticks - map->baseTicks) * WIDTH_ONE + map->spanTicks / 2) / map->spanTicks;
+	return (width < 0 || width > WIDTH_ONE) ? -1 : (int32_t)width;
+}
+
+// a time in nanoseconds as 16.16 ticks on this servo's board. Anything longer than
+// the cycle is out of range however it is used, so it is cut short just past the
+// cycle, which also keeps the product from overflowing.
+static int64_t nsec_ticks(int servo, int64_t nsec) {
+	const struct channel_map *map = &channelMap[servo];
+	if (nsec > map->cycleNSec) nsec = map->cycleNSec + 1;
+	if (nsec < -map->cycleNSec) nsec = -map->cycleNSec - 1;
+	return nsec * map->nsecScale / ((int64_t)1 << 32);
+}
+
+// check a calibration can be sent on this servo's board; returns an error message or NULL
+static const char *check_calibration(int servo, const struct servo_cal *cal) {
+	if (cal->minUSec < 0) return "min is too small";
+	if (cal->minUSec >= cal->maxUSec) return "min is >= max";
+	if (cal->minUSec + cal->trimUSec < 0) return "min + trim is below zero";
+	if (cal->maxUSec + cal->trimUSec > boards[servo / CHANNELS_PER_BOARD].cycleTimeUSec)
+		return "max + trim is larger than the cycle time";
+	if (cal->parkUSec >= 0 && (cal->parkUSec < cal->minUSec + cal->trimUSec
+			|| cal->parkUSec > cal->maxUSec + cal->trimUSec))
+		return "park is outside min..max after trim";
+	return NULL;
+}
+
+// parse a calibration time: a signed number of steps, or of microseconds with "us"
+static int parse_cal_value(char *arg, double *usec) {
+	char *p;
+	double val = strtod(arg, &p);
+
+	if (p == arg) return -1;
+	if (*p == '\0') {
+		*usec = val * stepTimeUSec;
+	} else if (!strcmp(p, "us")) {
+		*usec = val;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+// parse and apply a calibration such as "3 min=900us max=2100us trim=-12us invert",
+// where '*' means every servo, marking the servos it changes in changed[]. Nothing
+// is changed unless every servo it covers ends up with a usable calibration.
+static int parse_calibration(char *args, int *changed) {
+	static struct servo_cal cal[MAX_SERVOS];
+	char *word, *value, *saveptr, *p;
+	const char *err;
+	int servo, first, last;
+	double usec;
+
+	if ((word = strtok_r(args, " \t\r\n", &saveptr)) == NULL) return -1;
+	if (!strcmp(word, "*")) {
+		first = 0;
+		last = numServos - 1;
+	} else {
+		first = last = (int)strtol(word, &p, 10);
+		if (p == word || *p || first < 0 || first >= numServos) {
+			fprintf(stderr, "Invalid servo number %s in calibration\n", word);
+			return -1;
+		}
+	}
+	for (servo = first; servo <= last; servo++) {
+		cal[servo] = servoCal[servo];
+	}
+	while ((word = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+		if ((value = strchr(word, '=')) != NULL) *value++ = '\0';
+		if (!strcmp(word, "invert") || !strcmp(word, "noinvert")
+				|| !strcmp(word, "led") || !strcmp(word, "noled")) {
+			int on = word[0] != 'n';
+			int led = !strcmp(word + (on ? 0 : 2), "led");
+			if (value) {
+				on = (int)strtol(value, &p, 10);
+				if (p == value || *p || on < 0 || on > 1 || word[0] == 'n') {
+					fprintf(stderr, "Bad calibration setting %s=%s\n", word, value);
+					return -1;
+				}
+			}
+			for (servo = first; servo <= last; servo++) {
+				if (led) cal[servo].led = on;
+				else cal[servo].invert = on;
+			}
+			continue;
+		}
+		if (!strcmp(word, "park") && value && !strcmp(value, "mid")) {
+			for (servo = first; servo <= last; servo++) cal[servo].parkUSec = -1;
+			continue;
+		}
+		if (!value || parse_cal_value(value, &usec) < 0 || (!strcmp(word, "park") && usec < 0)) {
+			fprintf(stderr, "Bad calibration setting %s%s%s\n", word, value ? "=" : "", value ? value : "");
+			return -1;
+		}
+		for (servo = first; servo <= last; servo++) {
+			if (!strcmp(word, "min")) {
+				cal[servo].minUSec = usec;
+			} else if (!strcmp(word, "max")) {
+				cal[servo].maxUSec = usec;
+			} else if (!strcmp(word, "trim")) {
+				cal[servo].trimUSec = usec;
+			} else if (!strcmp(word, "park")) {
+				cal[servo].parkUSec = usec;
+			} else {
+				fprintf(stderr, "Unknown calibration setting %s\n", word);
+				return -1;
+			}
+		}
+	}
+	for (servo = first; servo <= last; servo++) {
+		if ((err = check_calibration(servo, &cal[servo])) != NULL) {
+			fprintf(stderr, "Bad calibration for servo %d: %s\n", servo, err);
+			return -1;
+		}
+	}
+	for (servo = first; servo <= last; servo++) {
+		servoCal[servo] = cal[servo];
+		build_channel_map(servo);
+		changed[servo] = 1;
+	}
+	return 0;
+}
+
+// give every servo the default range, then apply any calibration file over that.
+// The file has one calibration per line, as for the "cal" command but without
+// the "cal"; blank lines and lines starting with '#' are ignored.
+static void init_calibration(void) {
+	static int changed[MAX_SERVOS];
+	char line[1024], *p;
+	int servo, lineNumber = 0;
+	FILE *f;
+
+	for (servo = 0; servo < numServos; servo++) {
+		servoCal[servo].minUSec = servoMinPulseUSec;
+		servoCal[servo].maxUSec = servoMaxPulseUSec;
+		servoCal[servo].trimUSec = 0;
+		servoCal[servo].invert = 0;
+		servoCal[servo].parkUSec = -1;
+		servoCal[servo].led = 0;
+		build_channel_map(servo);
+	}
+	if (!calibrationFile) return;
+	if ((f = fopen(calibrationFile, "r")) == NULL)
+		fatal("pca9685servod: Failed to open %s: %m\n", calibrationFile);
+	while (fgets(line, sizeof(line), f)) {
+		lineNumber++;
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+		if (parse_calibration(p, changed) < 0)
+			fatal("pca9685servod: Bad calibration at %s line %d\n", calibrationFile, lineNumber);
+	}
+	fclose(f);
+}
+
+static struct servo_group *find_group(const char *name, size_t len) {
+	int i;
+	for (i = 0; i < numGroups; i++) {
+		if (!strncmp(groups[i].name, name, len) && groups[i].name[len] == '\0') return &groups[i];
+	}
+	return NULL;
+}
+
+// define (or redefine) a group from a list of servo numbers and ranges such as
+// "0-5,16-21,30". Names start with a letter so they can't be taken for servos.
+static int define_group(const char *name, char *list) {
+	static uint8_t member[MAX_SERVOS];
+	struct servo_group *group;
+	char *word, *saveptr, *p;
+	const char *c;
+	int first, last, servo;
+
+	if (!((*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z'))
+			|| strlen(name) >= MAX_GROUP_NAME) {
+		fprintf(stderr, "Invalid group name %s\n", name);
+		return -1;
+	}
+	for (c = name; *c; c++) {
+		if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == '_')) {
+			fprintf(stderr, "Invalid group name %s\n", name);
+			return -1;
+		}
+	}
+	memset(member, 0, sizeof(member));
+	for (word = strtok_r(list, ",", &saveptr); word; word = strtok_r(NULL, ",", &saveptr)) {
+		first = last = (int)strtol(word, &p, 10);
+		if (p != word && *p == '-') {
+			word = p + 1;
+			last = (int)strtol(word, &p, 10);
+		}
+		if (p == word || *p || first < 0 || last >= numServos || first > last) {
+			fprintf(stderr, "Invalid servos for group %s\n", name);
+			return -1;
+		}
+		for (servo = first; servo <= last; servo++) member[servo] = 1;
+	}
+	if ((group = find_group(name, strlen(name))) == NULL) {
+		if (numGroups == MAX_GROUPS) {
+			fprintf(stderr, "Too many groups; at most %d are supported\n", MAX_GROUPS);
+			return -1;
+		}
+		group = &groups[numGroups++];
+		strcpy(group->name, name);
+	}
+	memcpy(group->member, member, sizeof(member));
+	return 0;
+}
+
+// With --broadcast, give each group that is made up of two or more whole boards on
+// the same bus one of that bus's subaddresses, so identical updates to it can be
+// sent once. Only the groups defined at startup get one, since the chips are set
+// up to answer to them in init_board().
+static void assign_subaddresses(void) {
+	struct servo_group *group;
+	struct pca_bus *bus;
+	uint32_t mask;
+	int g, b, i, channel, count, whole;
+
+	for (i = 0; i < numBuses; i++) {
+		bus = &buses[i];
+		bus->broadcast = broadcastEnabled;
+		for (b = 0; b < bus->numBoards && bus->broadcast; b++) {
+			for (g = 0; g < NUM_SUBADDRESSES; g++) {
+				if (bus->boards[b]->address == ALLCALL_ADDRESS || bus->boards[b]->address == subAddresses[g]) {
+					fprintf(stderr, "Board 0x%02x on bus %d is at a broadcast address; not broadcasting on that bus\n",
+						bus->boards[b]->address, bus->number);
+					bus->broadcast = 0;
+					break;
+				}
+			}
+		}
+	}
+	for (g = 0; g < numGroups; g++) {
+		group = &groups[g];
+		bus = NULL;
+		mask = 0;
+		whole = 1;
+		for (b = 0; b < numBoards && whole; b++) {
+			for (channel = count = 0; channel < CHANNELS_PER_BOARD; channel++) {
+				count += group->member[b * CHANNELS_PER_BOARD + channel];
+			}
+			if (count == 0) continue;
+			if (count < CHANNELS_PER_BOARD || (bus && boards[b].bus != bus)) {
+				whole = 0;
+				break;
+			}
+			bus = boards[b].bus;
+			for (i = 0; bus->boards[i] != &boards[b]; i++)
+				;
+			mask |= 1u << i;
+		}
+		// one board is as well served by its own ALL_LED, and all of them by ALLCALL
+		if (!whole || !bus || !bus->broadcast || !(mask & (mask - 1))
+				|| mask == (1u << bus->numBoards) - 1 || bus->numSubgroups == NUM_SUBADDRESSES) continue;
+		for (i = 0; i < bus->numSubgroups && bus->subgroupBoards[i] != mask; i++)
+			;
+		if (i < bus->numSubgroups) continue;
+		bus->subgroupBoards[bus->numSubgroups] = mask;
+		for (b = 0; b < bus->numBoards; b++) {
+			if (mask & (1u << b)) bus->boards[b]->subBits |= subModeBits[bus->numSubgroups];
+		}
+		fprintf(stderr, "Group %s answers to 0x%02x on bus %d\n", group->name,
+			subAddresses[bus->numSubgroups], bus->number);
+		bus->numSubgroups++;
+	}
+}
+
+// work out the prescale for a wanted cycle time and return the cycle time it really gives
+static double calculateTimerSettings(double cycleTime, uint8_t *prescale) {
+    double freq = 1.0e6 / cycleTime;
+	*prescale = (CLOCK_FREQ / 4096 / freq)  - 1;
+	DPRINTF(("Setting prescale value to: %d\n", *prescale));
+	DPRINTF(("Actual frequency: %8.3f\n", (CLOCK_FREQ / 4096.0) / (*prescale + 1)));
+	// adjust the cycle time to reflect reality
+	cycleTime = 1e6 * (*prescale +1)/ (CLOCK_FREQ / 4096.0);
+	DPRINTF(("Actual cycle time: %8.3fus\n", cycleTime));
+	return cycleTime;
+}
+
+static void setPWMFreq(struct pca_board *board) {
+ 	uint8_t oldmode, newmode;
+ 	int ret;
+ 	
+ 	ret = pca_read_byte(&board->bus->i2c, board->address, MODE1);
+ 	oldmode = (uint8_t)ret;
+    newmode = (oldmode & ~SLEEP) | SLEEP;    //sleep
+	DPRINTF(("Setting prescale value to: %d\n", board->prescale));
+    write_reg(board, MODE1, newmode);        // go to sleep
+    write_reg(board, PRE_SCALE, board->prescale);
+    write_reg(board, MODE1, oldmode);
+    usleep(1000);
+    write_reg(board, MODE1, oldmode | RESTART);
+}
+
+// Warm restarts. The state file holds the servo positions (servoWidth[] is mapped
+// straight from it) and the settings each board was given. A board that still
+// holds those settings when the daemon starts is taken over as it is, with no
+// reset, sleeps or prescale change, so restarting doesn't make the servos move.
+// The new file is only put in place of the old once every board has been set up,
+// so a start that fails part way leaves the last good state for the next one.
+#define STATE_MAGIC 0x54535341  // "ASST"
+#define STATE_VERSION 2
+struct saved_board {
+    uint8_t bus;
+    uint8_t address;
+    uint8_t prescale;
+    uint8_t mode1;
+    uint8_t mode2;
+    uint8_t reserved;
+    uint16_t firstServo;        // where its channels are in width[]
+};
+struct saved_state {
+    uint32_t magic;             // only set once every board has been set up
+    uint16_t version;
+    uint16_t numBoards;
+    struct saved_board boards[MAX_BOARDS];
+    int32_t width[MAX_SERVOS];
+    uint8_t sent[MAX_SERVOS];   // channels some run has driven; the rest are left alone
+};
+static struct saved_state *savedState;
+static struct saved_state startState;       // collected while the boards are set up
+static struct saved_state previousState;    // as the last run left it
+static int warmChanged[MAX_SERVOS];         // adopted servos whose registers need updating
+static int numWarmBoards;
+
+// read what the last run left in the state file; the new state is collected in
+// startState until commit_state() replaces the file with it
+static void open_state(void) {
+    int fd;
+
+    if (!stateFile || !*stateFile) return;
+    if ((fd = open(stateFile, O_RDONLY)) >= 0) {
+        if (read(fd, &previousState, sizeof(previousState)) != sizeof(previousState)) {
+            memset(&previousState, 0, sizeof(previousState));
+        }
+        close(fd);
+    }
+    if (previousState.magic != STATE_MAGIC || previousState.version != STATE_VERSION
+            || previousState.numBoards > MAX_BOARDS) {
+        memset(&previousState, 0, sizeof(previousState));
+    }
+    savedState = &startState;
+    servoWidth = startState.width;
+    servoSent = startState.sent;
+}
+
+// Every board is set up: write the new state to a fresh file, rename it over the
+// old one and keep it mapped, so the positions are always saved without any extra
+// work from here on
+static void commit_state(void) {
+    struct saved_state *state = MAP_FAILED;
+    char tmpFile[256];
+    int fd;
+
+    if (!savedState) return;
+    startState.version = STATE_VERSION;
+    startState.numBoards = numBoards;
+    startState.magic = STATE_MAGIC;
+    snprintf(tmpFile, sizeof(tmpFile), "%s.new", stateFile);
+    if ((fd = open(tmpFile, O_RDWR | O_CREAT | O_TRUNC, 0644)) >= 0) {
+        if (ftruncate(fd, sizeof(*state)) == 0) {
+            state = mmap(NULL, sizeof(*state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    if (state != MAP_FAILED) {
+        memcpy(state, &startState, sizeof(*state));
+        if (rename(tmpFile, stateFile) == 0) {
+            savedState = state;
+            servoWidth = state->width;
+            servoSent = state->sent;
+            return;
+        }
+        munmap(state, sizeof(*state));
+    }
+    // the old file no longer matches the boards, so don't let it be adopted from
+    fprintf(stderr, "Can't keep state in %s (%m); restarts will reset the boards\n", stateFile);
+    unlink(tmpFile);
+    unlink(stateFile);
+}
+
+// note a board's settings once it is running with them
+static void save_board(struct pca_board *board) {
+    struct saved_board *saved;
+    int index = board - boards;
+
+    if (!savedState) return;
+    saved = &savedState->boards[index];
+    saved->bus = board->bus->number;
+    saved->address = board->address;
+    saved->prescale = board->prescale;
+    saved->mode1 = AI | ALLCALL | board->subBits;
+    saved->mode2 = OUTDRV;
+    saved->firstServo = index * CHANNELS_PER_BOARD;
+}
+
+// Take over a board left running by an earlier daemon if it still has the same
+// settings: read its registers back and carry on from the saved positions. Returns
+// -1 if it needs setting up from scratch.
+static int adopt_board(struct pca_board *board) {
+    const struct saved_board *saved = NULL;
+    uint8_t regs[LED15_OFF_H + 1], on_off[LED_MULTIPLYER];
+    int i, reg, prescale, servo, firstServo = (board - boards) * CHANNELS_PER_BOARD;
+
+    if (coldStart) return -1;
+    for (i = 0; i < previousState.numBoards; i++) {
+        if (previousState.boards[i].bus == board->bus->number
+                && previousState.boards[i].address == board->address) {
+            saved = &previousState.boards[i];
+        }
+    }
+    if (!saved || saved->prescale != board->prescale || saved->mode1 != (AI | ALLCALL | board->subBits)
+            || saved->firstServo + CHANNELS_PER_BOARD > MAX_SERVOS) {
+        return -1;
+    }
+
+    // MODE1 through the last LED register in one go, then the prescaler
+    if (read_regs(board, MODE1, regs, sizeof(regs)) < 0
+            || (prescale = pca_read_byte(&board->bus->i2c, board->address, PRE_SCALE)) < 0) {
+        return -1;
+    }
+    // RESTART may read back set; the chip is running either way
+    if ((regs[MODE1] & ~RESTART) != saved->mode1 || regs[MODE2] != saved->mode2
+            || prescale != saved->prescale) {
+        DPRINTF(("board 0x%02x: MODE1 0x%02x MODE2 0x%02x PRE_SCALE %d don't match\n",
+            board->address, regs[MODE1], regs[MODE2], prescale));
+        return -1;
+    }
+    if (board->bus->broadcast) {
+        if (regs[ALLCALLADR] != ALLCALL_ADDRESS << 1) return -1;
+        for (i = 0; i < NUM_SUBADDRESSES; i++) {
+            if (regs[subRegs[i]] != subAddresses[i] << 1) return -1;
+        }
+    }
+
+    for (reg = MODE1; reg <= LED15_OFF_H; reg++) {
+        board->shadow.regs[reg] = regs[reg];
+        shadow_mark(&board->shadow, reg, 0);
+    }
+    board->shadow.regs[PRE_SCALE] = prescale;
+    // if the calibration or --noflicker has changed since, the registers move to
+    // match once the bus workers start
+    for (i = 0; i < CHANNELS_PER_BOARD; i++) {
+        servo = firstServo + i;
+        servoWidth[servo] = previousState.width[saved->firstServo + i];
+        // a channel nobody has set is still off, and a limp servo stays limp
+        if (!previousState.sent[saved->firstServo + i]) continue;
+        servoSent[servo] = 1;
+        servo_registers(servo, on_off);
+        if (memcmp(on_off, &regs[LED0_ON_L + LED_MULTIPLYER * i], LED_MULTIPLYER)) {
+            warmChanged[servo] = 1;
+        }
+    }
+    return 0;
+}
+
+static void init_board(struct pca_board *board) {
+    uint8_t oldmode;
+    int i, ret;
+
+    // connect to the PCA9685 via i2c, quit if that fails
+    ret = pca_attach(&board->bus->i2c, board->address);
+    if (ret < 0)
+        fatal("Unable to connect to PCA9685 hardware at 0x%02x on bus %d\n",
+            board->address, board->bus->number);
+    DPRINTF(("pca handle = %d\n", ret));
+
+    if (adopt_board(board) == 0) {
+        fprintf(stderr, "Board 0x%02x on bus %d is already running; carrying on from where it was\n",
+            board->address, board->bus->number);
+        numWarmBoards++;
+        save_board(board);
+        return;
+    }
+    
+    // initialise the PCA; write config byte to reg 0
+    // See PCA9685.pdf 7.3.1
+    // exactly what is best here is a bit arguable. I see 0x20 or 0x21 or 0 used variously
+    // We want AI so that a whole channel (or run of channels) is one block write
+    
+    all_pwm_off(board);
+    if (board->bus->broadcast) {
+        // make sure the broadcast addresses are the ones we expect
+        write_reg(board, ALLCALLADR, ALLCALL_ADDRESS << 1);
+        for (i = 0; i < NUM_SUBADDRESSES; i++) {
+            write_reg(board, subRegs[i], subAddresses[i] << 1);
+        }
+    }
+    ret = write_reg(board, MODE1, AI | ALLCALL | board->subBits);
+    DPRINTF(("init_hardware MODE1 set = %d\n", ret));
+    
+    // maybe we should set some flags in MODE2 as well?
+    // 0xC is used in at least one python based driver
+    // Leave OCH clear so the outputs change on the i2c STOP rather than on each ACK.
+    // Every register written before the STOP then takes effect together, which is
+    // what lets a multi-channel update (or a committed transaction) land as one.
+     ret = write_reg(board, MODE2, OUTDRV );
+    DPRINTF(("init_hardware MODE2 set %d\n", ret));
+     // we have to wait for at least 500uS after setting the SLEEP flag to 0
+    usleep(10000);
+    ret = pca_read_byte(&board->bus->i2c, board->address, MODE1);
+    oldmode = (uint8_t)ret;
+    
+    ret = write_reg(board, MODE1, (oldmode & ~SLEEP));
+    usleep(10000);
+ 
+    setPWMFreq(board);
+    save_board(board);
+}
+
+// log a register write for --record
+static void record_write(struct pca_backend *be, int addr, int reg, const uint8_t *buf, int count, int result) {
+    uint8_t head[2] = { (uint8_t)addr, (uint8_t)reg };
+    struct pca_record_failure failure = { result, (uint8_t)addr, (uint8_t)reg };
+
+    if (result < 0) {
+        pca_record(PCA_REC_WRITE_FAILED, be->bus, &failure, sizeof(failure), buf, count);
+    } else {
+        pca_record(PCA_REC_WRITE, be->bus, head, sizeof(head), buf, count);
+    }
+}
+
+// start recording, before the boards are set up so that is in the log too
+// Register writes always go to the flight recorder, and to the --record log if
+// there is one
+static void open_record(void) {
+    static struct pca_record_board info[MAX_BOARDS];
+    int i, ret;
+
+    for (i = 0; i < numBoards; i++) {
+        info[i].bus = boards[i].bus->number;
+        info[i].address = boards[i].address;
+        info[i].cycleTimeUSec = (uint32_t)boards[i].cycleTimeUSec;
+    }
+    pca_flight_init(info, numBoards);
+    if (recordFile && (ret = pca_record_open(recordFile, RECORD_MAX_BYTES, info, numBoards)) < 0)
+        fatal("pca9685servod: Failed to start recording to %s: %s\n", recordFile, strerror(-ret));
+    for (i = 0; i < numBuses; i++) {
+        buses[i].i2c.trace = record_write;
+    }
+}
+
+static void init_hardware(void) {
+    struct pca_bus *bus;
+    int i;
+
+    for (i = 0; i < numBuses; i++) {
+        bus = &buses[i];
+        // connect to the i2c backend (normally pigpiod), quit if that fails
+        if (pca_backend_open(&bus->i2c, backendSpec, bus->number) < 0)
+            fatal("Unable to start the %s i2c backend for bus %d\n", backendSpec, bus->number);
+        DPRINTF(("using the %s backend on bus %d\n", bus->i2c.ops->name, bus->number));
+        bus->useBlockWrites = 1;
+        pthread_mutex_init(&bus->lock, NULL);
+        if ((bus->wakeFd = eventfd(0, 0)) < 0)
+            fatal("pca9685servod: Failed to create an eventfd for bus %d: %m\n", bus->number);
+        pthread_cond_init(&bus->verified, NULL);
+    }
+    open_record();
+    open_state();
+    for (i = 0; i < numBoards; i++) {
+        init_board(&boards[i]);
+    }
+    commit_state();
+}
+
+// add a board, giving it its own bus worker if it is the first on that bus
+static void add_board(int busNumber, unsigned int address, double cycleTime) {
+    struct pca_board *board;
+    struct pca_bus *bus = NULL;
+    int i;
+
+    if (numBoards == MAX_BOARDS)
+        fatal("Too many boards; at most %d are supported\n", MAX_BOARDS);
+    if (address < 0x03 || address > 0x77)
+        fatal("Invalid i2c device address 0x%02x\n", address);
+    for (i = 0; i < numBuses; i++) {
+        if (buses[i].number == busNumber) bus = &buses[i];
+    }
+    if (!bus) {
+        bus = &buses[numBuses++];
+        bus->number = busNumber;
+    }
+    for (i = 0; i < bus->numBoards; i++) {
+        if (bus->boards[i]->address == address)
+            fatal("Board 0x%02x on bus %d given twice\n", address, busNumber);
+    }
+    board = &boards[numBoards++];
+    board->bus = bus;
+    board->address = address;
+    board->cycleTimeUSec = calculateTimerSettings(cycleTime, &board->prescale);
+    bus->boards[bus->numBoards++] = board;
+    numServos = numBoards * CHANNELS_PER_BOARD;
+}
+
+// parse a cycle time argument of N or Nus, returning -1 if it is no good
+static double parseCycleTime(char *arg) {
+	char *p;
+	double cycleTime = strtol(arg, &p, 10);
+	if (*arg < '0' || *arg > '9' ||
+			(*p && strcmp(p, "us")) ||
+			cycleTime < MIN_cycleTimeUSec ||
+			cycleTime > MAX_cycleTimeUSec)
+		return -1;
+	return cycleTime;
+}
+
+// parse a --board=BUS:ADDR[:CYCLE] argument
+static void parseBoardArg(char *arg) {
+	char *p, *q;
+	int busNumber;
+	unsigned int address;
+	double cycleTime = cycleTimeUSec;
+
+	busNumber = (int)strtol(arg, &p, 10);
+	if (p == arg || *p != ':')
+		fatal("Invalid board '%s'; expected BUS:ADDR[:CYCLE]\n", arg);
+	address = (unsigned int)strtol(p + 1, &q, 0);
+	if (q == p + 1 || (*q && *q != ':'))
+		fatal("Invalid board '%s'; expected BUS:ADDR[:CYCLE]\n", arg);
+	if (*q == ':' && (cycleTime = parseCycleTime(q + 1)) < 0)
+		fatal("Invalid cycle-time for board '%s'\n", arg);
+	add_board(busNumber, address, cycleTime);
+}
+
+// LED channels take raw ticks, 0 to 4096 for fully on, or a brightness in
+// 1/10000ths. Brightness goes through a table made from --gamma at startup, so
+// equal steps look equal; either way the width is the fraction of the cycle the
+// LED is on for, and turning that into registers is a shift.
+static uint16_t gammaTicks[10001];
+
+static void init_gamma(void) {
+	int i;
+	for (i = 0; i <= 10000; i++) {
+		gammaTicks[i] = (uint16_t)lround(4096.0 * pow(i / 10000.0, ledGamma));
+	}
+}
+
+// the lowest brightness that gives at least this many ticks
+static int led_brightness(int ticks) {
+	int lo = 0, hi = 10000, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (gammaTicks[mid] < ticks) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// an LED's width for some ticks or a brightness, added to width if relative, or
+// -1 if it is out of range
+static int32_t led_width(int32_t width, int brightness, int relative, int64_t amount) {
+	int ticks = (int)(((int64_t)width * 4096 + WIDTH_ONE / 2) / WIDTH_ONE);
+
+	if (brightness) {
+		if (relative) amount += led_brightness(ticks);
+		if (amount < 0 || amount > 10000) return -1;
+		return (int32_t)gammaTicks[amount] * WIDTH_ONE / 4096;
+	}
+	if (relative) amount += ticks;
+	if (amount < 0 || amount > 4096) return -1;
+	return (int32_t)(amount * WIDTH_ONE / 4096);
+}
+
+// turn a parsed width into a 16.16 fraction of the servo's min..max range, or -1
+// if it is outside it. Microseconds and steps are the pulse actually sent, trim
+// and inversion included, and a percentage is a position in the range. A relative
+// width is added in its own unit to where the servo is going, so +10 is ten steps
+// and +10us ten microseconds whatever the range.
+static int32_t parse_width(int servo, int32_t current_width, const struct pca_assignment *a) {
+	int64_t amount, ticks;
+
+	// a bare number is ticks and a percentage brightness; an LED has no use for
+	// microseconds
+	if (servoCal[servo].led) {
+		if (a->unit == PCA_UNIT_USEC) return -1;
+		if (a->unit == PCA_UNIT_PERCENT) {
+			amount = (a->value + PCA_PARSE_SCALE / 200) / (PCA_PARSE_SCALE / 100);
+		} else {
+			amount = (a->value + PCA_PARSE_SCALE / 2) / PCA_PARSE_SCALE;
+		}
+		return led_width(current_width, a->unit == PCA_UNIT_PERCENT, a->sign != 0,
+			a->sign < 0 ? -amount : amount);
+	}
+	DPRINTF(( "width %c%f in unit %d\n", a->sign > 0 ? '+' : a->sign < 0 ? '-' : ' ',
+		(double)a->value / PCA_PARSE_SCALE, a->unit));
+	if (a->unit == PCA_UNIT_PERCENT) {
+		// more than the whole range is out of it whichever way it goes
+		if (a->value > 100 * (int64_t)PCA_PARSE_SCALE) return -1;
+		amount = a->value * WIDTH_ONE / (100 * (int64_t)PCA_PARSE_SCALE);
+		if (a->sign) amount = current_width + a->sign * amount;
+		return (amount < 0 || amount > WIDTH_ONE) ? -1 : (int32_t)amount;
+	}
+	// in nanoseconds, the parser's fixed point having six decimal places
+	amount = a->value / (PCA_PARSE_SCALE / 1000);
+	if (a->unit == PCA_UNIT_STEPS) amount = amount * stepNSec / 1000;
+	ticks = nsec_ticks(servo, a->sign < 0 ? -amount : amount);
+	if (a->sign) ticks += width_ticks(servo, current_width);
+	return ticks_width(servo, ticks);
+}
+
+// A timed move in progress. Each frame the scheduler works out where the servo
+// should be by now and sends that, until the move is done.
+struct trajectory {
+	int active;
+	int32_t from, to;           // 16.16 widths, like servoWidth
+	uint64_t startNSec;         // CLOCK_MONOTONIC
+	uint64_t durationNSec;
+	int curve;
+};
+static struct trajectory trajectories[MAX_SERVOS];
+static int movingServos;        // how many trajectories are active
+
+// Targets collected while draining the FIFO. Lines are folded in here as they are
+// parsed, so if a producer has queued up several positions for a servo only the
+// newest one ever reaches the hardware. Relative moves build on the pending value.
+struct pending_target {
+	int changed;
+	int32_t width;              // 16.16, like servoWidth
+	int durationMSec;           // 0 to jump straight there
+	int curve;
+};
+static struct pending_target pending[MAX_SERVOS];
+
+// where the servo has been told to go: the end of any move in progress, or else
+// where it is now
+static int32_t commanded_width(int servo) {
+	return trajectories[servo].active ? trajectories[servo].to : servoWidth[servo];
+}
+
+// Targets from the command being parsed, held back until the whole command has
+// been checked. stagedCommand[] says which entries belong to the current command.
+static struct pending_target staged[MAX_SERVOS];
+static unsigned int stagedCommand[MAX_SERVOS];
+static unsigned int commandCount;
+static int touched[MAX_SERVOS];
+static int numTouched;
+
+// Between "begin" and "commit" a source's targets collect here rather than in the
+// pending ones, so a pose built up over several commands goes out in one flush. The
+// FIFO has one of these and each control connection has its own.
+struct transaction {
+	int open;
+	uint64_t startNSec;
+	struct pending_target target[MAX_SERVOS];
+	int touched[MAX_SERVOS];
+	int numTouched;
+};
+static struct transaction *currentTxn;  // for the command being parsed, NULL if its source has none
+
+// the transaction the command being parsed should stage into, if any
+static struct transaction *open_transaction(void) {
+	return (currentTxn && currentTxn->open) ? currentTxn : NULL;
+}
+
+static int reject(int reason) {
+	stats.rejected[reason]++;
+	return -1;
+}
+
+static void stage_begin(void) {
+	commandCount++;
+	numTouched = 0;
+}
+
+// relative widths build on any earlier, not yet sent, target for this servo, or
+// else on where it was last told to go
+static int32_t staged_width(int servo) {
+	struct transaction *txn = open_transaction();
+
+	if (stagedCommand[servo] == commandCount) return staged[servo].width;
+	if (txn && txn->target[servo].changed) return txn->target[servo].width;
+	if (pending[servo].changed) return pending[servo].width;
+	return commanded_width(servo);
+}
+
+static void stage_target(int servo, int32_t width, int durationMSec, int curve) {
+	if (stagedCommand[servo] != commandCount) {
+		stagedCommand[servo] = commandCount;
+		touched[numTouched++] = servo;
+	}
+	staged[servo].changed = 1;
+	staged[servo].width = width;
+	staged[servo].durationMSec = durationMSec;
+	staged[servo].curve = curve;
+}
+
+// the command was good, so its targets join the pending ones, or those of the
+// transaction it is part of
+static void stage_commit(void) {
+	struct transaction *txn = open_transaction();
+	int servo;
+	while (numTouched > 0) {
+		servo = touched[--numTouched];
+		stats.assignments++;
+		if (txn) {
+			if (!txn->target[servo].changed) txn->touched[txn->numTouched++] = servo;
+			txn->target[servo] = staged[servo];
+			continue;
+		}
+		if (pending[servo].changed) stats.coalesced++;
+		pending[servo] = staged[servo];
+	}
+}
+
+// close a transaction, handing its targets to apply_pending() if it is committed.
+// They then all go out in the same set_servos() call, which gives each bus one
+// flush, and timed moves in it all start on the same frame.
+static void end_transaction(struct transaction *txn, int commit) {
+	int servo;
+	while (txn->numTouched > 0) {
+		servo = txn->touched[--txn->numTouched];
+		if (commit) {
+			if (pending[servo].changed) stats.coalesced++;
+			pending[servo] = txn->target[servo];
+		}
+		txn->target[servo].changed = 0;
+	}
+	txn->open = 0;
+	if (commit) stats.commits++;
+	else stats.aborts++;
+}
+
+// does the line hold just this word, give or take whitespace?
+static int is_keyword(const char *line, const char *word) {
+	size_t len = strlen(word);
+	if (strncmp(line, word, len)) return 0;
+	for (line += len; *line; line++) {
+		if (*line != ' ' && *line != '\t' && *line != '\r' && *line != '\n') return 0;
+	}
+	return 1;
+}
+
+// handle begin, commit and abort for the current source
+static int transaction_command(const char *line) {
+	struct transaction *txn = currentTxn;
+
+	if (!txn) {
+		fprintf(stderr, "Transactions need the FIFO or the control socket\n");
+		return reject(REJECT_TRANSACTION);
+	}
+	if (is_keyword(line, "begin")) {
+		if (txn->open) {
+			fprintf(stderr, "Already in a transaction\n");
+			return reject(REJECT_TRANSACTION);
+		}
+		txn->open = 1;
+		txn->startNSec = monotonic_nsec();
+		return 0;
+	}
+	if (!txn->open) {
+		fprintf(stderr, "Not in a transaction\n");
+		return reject(REJECT_TRANSACTION);
+	}
+	end_transaction(txn, is_keyword(line, "commit"));
+	return 0;
+}
+
+static int stopRequested;       // a stop or park is waiting for the main loop to act on
+static void abort_transactions(void);
+
+// park is the pulse actually sent, so take the trim and inversion back off it
+static int32_t park_width(const struct servo_cal *cal) {
+	double width = (cal->parkUSec - cal->trimUSec - cal->minUSec) / (cal->maxUSec - cal->minUSec);
+	return (int32_t)lround((cal->invert ? 1.0 - width : width) * WIDTH_ONE);
+}
+
+// "stop" holds every servo where it is: moves in progress end wherever they have
+// got to, targets not yet sent are dropped and every open transaction is aborted.
+// "park" does the same, then sends each servo to its park position (mid range
+// unless its calibration says otherwise), as a timed move with "park@2s:inout".
+static int halt_command(const char *line) {
+	const char *p = line + 4;
+	uint32_t durationMSec = 0;
+	uint8_t curve = PCA_CURVE_LINEAR;
+	const struct servo_cal *cal;
+	int servo, park = line[0] == 'p';
+
+	if (park && *p == '@') {
+		p = pca_parse_move(p + 1, p + strlen(p), &durationMSec, &curve);
+		if (!p || !is_keyword(p, "") || durationMSec > MAX_MOVE_MSEC) {
+			fprintf(stderr, "Invalid move time: %s\n", line + 5);
+			return reject(REJECT_DURATION);
+		}
+	}
+	stats.stops++;
+	for (servo = 0; servo < numServos; servo++) {
+		trajectories[servo].active = 0;
+		pending[servo].changed = 0;
+	}
+	movingServos = 0;
+	abort_transactions();
+	stopRequested = 1;
+	if (!park) return 0;
+
+	for (servo = 0; servo < numServos; servo++) {
+		cal = &servoCal[servo];
+		pending[servo].changed = 1;
+		// LEDs park dark
+		pending[servo].width = cal->led ? 0 : cal->parkUSec < 0 ? WIDTH_ONE / 2
+			: park_width(cal);
+		pending[servo].durationMSec = durationMSec;
+		pending[servo].curve = curve;
+	}
+	return 0;
+}
+
+// the assignment starting at *p, for error messages: skip to its first character
+// and return its length up to the next comma
+static int assignment_text(const char **p, const char *end) {
+	const char *q;
+	while (*p < end && (**p == ',' || **p == ' ' || **p == '\t')) (*p)++;
+	for (q = *p; q < end && *q != ','; q++)
+		;
+	while (q > *p && (q[-1] == ' ' || q[-1] == '\t' || q[-1] == '\r' || q[-1] == '\n')) q--;
+	return (int)(q - *p);
+}
+
+// parse a command line of one or more comma separated assignments such as
+//   0=50%,3=1200us,7=+10,8=80%@750ms:inout
+// where '*' as the servo number means every servo and '@' makes a timed move. The
+// whole line is checked before any of it is accepted so a typo can't leave a pose
+// half applied; the result is merged into the pending targets for apply_pending(),
+// or held in the source's transaction between "begin" and "commit".
+static int process_command(char *line) {
+	struct pca_parser ps;
+	struct pca_assignment a;
+	struct servo_group *group;
+	const uint8_t *members;
+	const char *text;
+	int servo, first, last, status, len;
+	int32_t width;
+
+	if (is_keyword(line, "begin") || is_keyword(line, "commit") || is_keyword(line, "abort")) {
+		return transaction_command(line);
+	}
+	if (is_keyword(line, "stop") || is_keyword(line, "park") || !strncmp(line, "park@", 5)) {
+		return halt_command(line);
+	}
+	if (!strncmp(line, "group ", 6)) {
+		char *name, *list, *saveptr;
+		if ((name = strtok_r(line + 6, " \t\r\n", &saveptr)) == NULL
+				|| (list = strtok_r(NULL, " \t\r\n", &saveptr)) == NULL) {
+			fprintf(stderr, "Bad input: group needs a name and a list of servos\n");
+			return reject(REJECT_SYNTAX);
+		}
+		return define_group(name, list) < 0 ? reject(REJECT_SERVO) : 0;
+	}
+	if (!strncmp(line, "cal ", 4)) {
+		static int changed[MAX_SERVOS];
+		stats.commands++;
+		// a calibration takes effect straight away, so it can't wait for the
+		// commit and go out together with the rest of a transaction
+		if (open_transaction()) {
+			fprintf(stderr, "cal can't be used inside a transaction\n");
+			return reject(REJECT_TRANSACTION);
+		}
+		memset(changed, 0, sizeof(changed));
+		// the servos keep their positions within the new range
+		if (parse_calibration(line + 4, changed) < 0) return reject(REJECT_CALIBRATION);
+		set_servos(changed, monotonic_nsec());
+		return 0;
+	}
+
+	stats.commands++;
+	if (line[0] == '?') {
+		fprintf(stderr, "Queries need a reply path; use the control socket\n");
+		return reject(REJECT_SYNTAX);
+	}
+	stage_begin();
+	pca_parse_init(&ps, line, strlen(line));
+	for (;;) {
+		text = ps.pos;
+		if ((status = pca_parse_next(&ps, &a)) != PCA_PARSE_OK) break;
+		members = NULL;
+		first = 0;
+		last = numServos - 1;
+		if (a.target == PCA_TARGET_GROUP) {
+			if ((group = find_group(a.name, a.nameLen)) == NULL) {
+				fprintf(stderr, "Unknown group %.*s\n", (int)a.nameLen, a.name);
+				return reject(REJECT_SERVO);
+			}
+			members = group->member;
+		} else if (a.target == PCA_TARGET_SERVO) {
+			if (a.servo >= (uint32_t)numServos) {
+				fprintf(stderr, "Invalid servo number %u\n", a.servo);
+				return reject(REJECT_SERVO);
+			}
+			first = last = a.servo;
+		}
+		if (a.durationMSec > MAX_MOVE_MSEC) {
+			fprintf(stderr, "Invalid move time (%u ms) specified\n", a.durationMSec);
+			return reject(REJECT_DURATION);
+		}
+
+		for (servo = first; servo <= last; servo++) {
+			if (members && !members[servo]) continue;
+			width = parse_width(servo, staged_width(servo), &a);
+			if (width < 0) {
+				len = assignment_text(&text, ps.end);
+				fprintf(stderr, "Invalid width (%.*s) specified for servo %d\n", len, text, servo);
+				return reject(REJECT_WIDTH);
+			}
+			stage_target(servo, width, a.durationMSec, a.curve);
+		}
+	}
+	if (status != PCA_PARSE_DONE) {
+		text = ps.pos;
+		len = assignment_text(&text, ps.end);
+		fprintf(stderr, "%s: %.*s\n", status == PCA_PARSE_WIDTH ? "Invalid width"
+			: status == PCA_PARSE_DURATION ? "Invalid move time" : "Bad input", len, text);
+		return reject(status == PCA_PARSE_WIDTH ? REJECT_WIDTH
+			: status == PCA_PARSE_DURATION ? REJECT_DURATION : REJECT_SYNTAX);
+	}
+
+	stage_commit();
+	return 0;
+}
+
+// the pulse a width sends, in microseconds, for queries
+static double width_to_usec(int servo, int32_t width) {
+	return width_ticks(servo, width) * boards[servo / CHANNELS_PER_BOARD].cycleTimeUSec / (4096.0 * WIDTH_ONE);
+}
+
+// turn a binary protocol value of the given kind into a 16.16 width, or -1 if it
+// is out of range. Relative values are added to base. As with text commands, ticks
+// and microseconds are the pulse actually sent.
+static int32_t value_to_width(int servo, int kind, int relative, int32_t value, int32_t base) {
+	int64_t ticks, width;
+
+	if (servoCal[servo].led) {
+		if (kind != PCA_VALUE_TICKS && kind != PCA_VALUE_PERMYRIAD) return -1;
+		return led_width(base, kind == PCA_VALUE_PERMYRIAD, relative, value);
+	}
+	switch (kind) {
+	case PCA_VALUE_TICKS:
+		if (value < -4096 || value > 4096) return -1;
+		// aim for the middle of an absolute tick so the conversion back lands on it
+		ticks = relative ? width_ticks(servo, base) + ((int64_t)value << WIDTH_SHIFT)
+			: ((int64_t)value << WIDTH_SHIFT) + WIDTH_ONE / 2;
+		return ticks_width(servo, ticks);
+	case PCA_VALUE_USEC:
+		ticks = nsec_ticks(servo, (int64_t)value * 1000);
+		return ticks_width(servo, ticks + (relative ? width_ticks(servo, base) : 0));
+	case PCA_VALUE_PERMYRIAD:
+		width = (int64_t)value * WIDTH_ONE / 10000 + (relative ? base : 0);
+		return (width < 0 || width > WIDTH_ONE) ? -1 : (int32_t)width;
+	default:
+		return -1;
+	}
+}
+
+// check and stage one binary protocol message; the status goes in the ack
+static void process_message(const uint8_t *buf, ssize_t len, struct pca_msg_ack *ack) {
+	const struct pca_msg_header *hdr = (const struct pca_msg_header *)buf;
+	const struct pca_msg_item *item;
+	int32_t width;
+	int i;
+
+	memset(ack, 0, sizeof(*ack));
+	ack->magic = PCA_PROTO_MAGIC;
+	ack->version = PCA_PROTO_VERSION;
+	stats.messages++;
+	if (len < (ssize_t)sizeof(*hdr)) {
+		ack->status = PCA_STATUS_BAD_LENGTH;
+		reject(REJECT_MESSAGE);
+		return;
+	}
+	ack->seq = hdr->seq;
+	if (hdr->magic != PCA_PROTO_MAGIC) {
+		ack->status = PCA_STATUS_BAD_MAGIC;
+	} else if (hdr->version != PCA_PROTO_VERSION) {
+		ack->status = PCA_STATUS_BAD_VERSION;
+	} else if (hdr->op != PCA_OP_SET) {
+		ack->status = PCA_STATUS_BAD_OP;
+	} else if (hdr->count > PCA_PROTO_MAX_ITEMS ||
+			len != (ssize_t)(sizeof(*hdr) + hdr->count * sizeof(*item))) {
+		ack->status = PCA_STATUS_BAD_LENGTH;
+	}
+	if (ack->status != PCA_STATUS_OK) {
+		reject(REJECT_MESSAGE);
+		return;
+	}
+
+	stage_begin();
+	item = (const struct pca_msg_item *)(hdr + 1);
+	for (i = 0; i < hdr->count; i++, item++) {
+		ack->badItem = i;
+		if (item->servo >= numServos) {
+			ack->status = PCA_STATUS_BAD_SERVO;
+			reject(REJECT_SERVO);
+			return;
+		}
+		if (item->durationMSec > MAX_MOVE_MSEC) {
+			ack->status = PCA_STATUS_BAD_VALUE;
+			reject(REJECT_DURATION);
+			return;
+		}
+		width = value_to_width(item->servo, item->kind, item->flags & PCA_ITEM_RELATIVE,
+			item->value, staged_width(item->servo));
+		if (width < 0) {
+			ack->status = PCA_STATUS_BAD_VALUE;
+			reject(REJECT_WIDTH);
+			return;
+		}
+		stage_target(item->servo, width, item->durationMSec, PCA_CURVE_LINEAR);
+	}
+	stage_commit();
+	stats.items += hdr->count;
+	ack->applied = hdr->count;
+	ack->badItem = 0;
+}
+
+// create the shared-memory target table and map it
+static void open_shm(void) {
+	size_t size = PCA_SHM_SIZE(numServos);
+	int fd;
 
-// uncomment this next line if you want a lot of debug output
-// #define DEBUG 1
+	unlink(shmFile);
+	if ((fd = open(shmFile, O_RDWR | O_CREAT | O_EXCL, 0666)) < 0)
+		fatal("pca9685servod: Failed to create %s: %m\n", shmFile);
+	// the umask may have taken some permissions away
+	if (fchmod(fd, 0666) < 0 || ftruncate(fd, size) < 0)
+		fatal("pca9685servod: Failed to set up %s: %m\n", shmFile);
+	shmTable = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shmTable == MAP_FAILED)
+		fatal("pca9685servod: Failed to map %s: %m\n", shmFile);
+	close(fd);
+	shmTable->version = PCA_SHM_VERSION;
+	shmTable->numSlots = numServos;
+	shmTable->cycleTimeUSec = (uint32_t)(boards[0].cycleTimeUSec + 0.5);
+	// clients check the magic last, so they never see a half made table
+	__atomic_store_n(&shmTable->magic, PCA_SHM_MAGIC, __ATOMIC_RELEASE);
+}
 
-#ifndef  DEBUG
-# define DEBUG	0
-#endif
+// once per frame: stage every slot a client has written to since last time. A slot
+// caught mid-write is simply picked up on the next frame.
+static void sample_shm(void) {
+	static uint32_t seen[MAX_SERVOS];
+	struct pca_shm_slot slot;
+	struct pca_record_shm rec;
+	int32_t width;
+	int servo;
+
+	stage_begin();
+	for (servo = 0; servo < numServos; servo++) {
+		if (pca_shm_read(shmTable, servo, &slot) < 0 || slot.seq == seen[servo]) continue;
+		seen[servo] = slot.seq;
+		width = value_to_width(servo, slot.kind, 0, slot.value, 0);
+		if (width < 0 || slot.durationMSec > MAX_MOVE_MSEC) {
+			fprintf(stderr, "Invalid value in shared memory slot %d\n", servo);
+			reject(REJECT_SHM);
+			continue;
+		}
+		stage_target(servo, width, slot.durationMSec, PCA_CURVE_LINEAR);
+		stats.shmUpdates++;
+		rec = (struct pca_record_shm){ servo, slot.kind, 0, slot.value, slot.durationMSec };
+		pca_record(PCA_REC_SHM, PCA_SRC_SHM, &rec, sizeof(rec), NULL, 0);
+	}
+	stage_commit();
+	__atomic_store_n(&shmTable->frames, shmTable->frames + 1, __ATOMIC_RELEASE);
+}
 
+// send the pending targets collected from the last drain of the FIFO. Timed moves
+// just get their trajectory set up here; the frame scheduler does the rest. now is
+// when the input they came from arrived.
+static void apply_pending(uint64_t now) {
+	static int changed[MAX_SERVOS];
+	struct trajectory *t;
+	struct pca_record_target rec;
+	int servo, any = 0;
+
+	for (servo = 0; servo < numServos; servo++) {
+		changed[servo] = 0;
+		if (!pending[servo].changed) continue;
+		pending[servo].changed = 0;
+		t = &trajectories[servo];
+		rec = (struct pca_record_target){ servo, pending[servo].curve, 0,
+			pending[servo].width, pending[servo].durationMSec };
+		pca_record(PCA_REC_TARGET, 0, &rec, sizeof(rec), NULL, 0);
+		if (pending[servo].durationMSec > 0) {
+			DPRINTF(( "move servo[%d] to %f %% over %dms\n", servo, pending[servo].width * 100.0 / WIDTH_ONE,
+				pending[servo].durationMSec));
+			// start from wherever it has got to, even part way through another move
+			if (!t->active) movingServos++;
+			t->active = 1;
+			t->from = servoWidth[servo];
+			t->to = pending[servo].width;
+			t->startNSec = now;
+			t->durationNSec = (uint64_t)pending[servo].durationMSec * 1000000ULL;
+			t->curve = pending[servo].curve;
+		} else {
+			DPRINTF(( "set servo[%d]=%f %%\n", servo, pending[servo].width * 100.0 / WIDTH_ONE));
+			// a plain position cancels any move in progress
+			if (t->active) {
+				t->active = 0;
+				movingServos--;
+			}
+			servoWidth[servo] = pending[servo].width;
+			changed[servo] = 1;
+			any = 1;
+		}
+	}
+	if (any) {
+		set_servos(changed, now);
+	}
+}
 
-#if (DEBUG)
-void __sq_DPRINTF(const char *fmt, ...);
-# define DPRINTF(ARGS) __sq_DPRINTF ARGS
-#else
-# define DPRINTF(ARGS)	((void)0)
-#endif
+// shape the progress of a move, both 16.16 fractions
+static int32_t ease(int curve, int32_t t) {
+	int64_t t2 = (int64_t)t * t;
+	switch (curve) {
+	case PCA_CURVE_IN:    return (int32_t)(t2 >> WIDTH_SHIFT);
+	case PCA_CURVE_OUT:   return WIDTH_ONE - (int32_t)(((int64_t)(WIDTH_ONE - t) * (WIDTH_ONE - t)) >> WIDTH_SHIFT);
+	case PCA_CURVE_INOUT: return (int32_t)((t2 * (3 * WIDTH_ONE - 2 * t)) >> (2 * WIDTH_SHIFT));
+	default:          return t;
+	}
+}
 
+// one frame of the motion scheduler: step every moving servo to where it should be
+// now and send them all together as a single batched update
+static void motion_frame(void) {
+	static int changed[MAX_SERVOS];
+	struct trajectory *t;
+	uint64_t now = monotonic_nsec();
+	int32_t progress;
+	int servo, any = 0;
+
+	for (servo = 0; servo < numServos; servo++) {
+		changed[servo] = 0;
+		t = &trajectories[servo];
+		if (!t->active) continue;
+		if (now - t->startNSec >= t->durationNSec) {
+			servoWidth[servo] = t->to;
+			t->active = 0;
+			movingServos--;
+		} else {
+			progress = (int32_t)(((now - t->startNSec) << WIDTH_SHIFT) / t->durationNSec);
+			servoWidth[servo] = t->from + (int32_t)((int64_t)(t->to - t->from) * ease(t->curve, progress) / WIDTH_ONE);
+		}
+		changed[servo] = 1;
+		any = 1;
+	}
+	if (any) {
+		set_servos(changed, now);
+	}
+}
 
-void 
-__sq_DPRINTF(const char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  vfprintf(stderr,fmt, ap);
-  va_end(ap);
+// run the frame timer while anything is moving and stop it when nothing is, so
+// an idle daemon doesn't wake up 50 times a second for no reason
+static void arm_frame_timer(int timerFd, int *armed) {
+	struct itimerspec its;
+	double frameUSec;
+	int i;
+
+	// the shared-memory table needs sampling every frame regardless
+	int wanted = movingServos > 0 || shmTable != NULL;
+
+	if (wanted == *armed) return;
+	memset(&its, 0, sizeof(its));
+	if (wanted) {
+		// tick at the fastest board's real PWM cycle time
+		frameUSec = boards[0].cycleTimeUSec;
+		for (i = 1; i < numBoards; i++) {
+			if (boards[i].cycleTimeUSec < frameUSec) frameUSec = boards[i].cycleTimeUSec;
+		}
+		its.it_interval.tv_sec = (time_t)(frameUSec / 1e6);
+		its.it_interval.tv_nsec = (long)(fmod(frameUSec, 1e6) * 1000.0);
+		framePeriodNSec = its.it_interval.tv_sec * 1000000000ULL + its.it_interval.tv_nsec;
+		frameNextNSec = monotonic_nsec() + framePeriodNSec;
+		its.it_value.tv_sec = frameNextNSec / 1000000000ULL;
+		its.it_value.tv_nsec = frameNextNSec % 1000000000ULL;
+	}
+	if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		fatal("pca9685servod: Failed to set the frame timer: %m\n");
+	*armed = wanted;
 }
 
+// Text input arrives in arbitrary chunks; a line_buffer gathers it back into lines
+struct line_buffer {
+	char line[1024];
+	int numChars;
+	int tossing;                // set while throwing away the rest of an over-long line
+};
+
+// split a chunk of input into lines, calling handle() on each complete one
+static void feed_lines(struct line_buffer *lb, char *buf, int n, void (*handle)(char *line, void *arg), void *arg) {
+	char *start = buf, *nl;
+	int len;
+
+	while (start < buf + n) {
+		nl = memchr(start, '\n', buf + n - start);
+		len = (nl ? nl + 1 : buf + n) - start;
+		if (!lb->tossing && lb->numChars + len >= 1022) {
+		    // if it gets too big, throw the whole line away as a brutal
+		    // but effective preventative of buffer overrun
+			fprintf(stderr, "Too much input; tossing out a line of over 1022 chars. Be more careful!\n");
+			reject(REJECT_TOO_LONG);
+			lb->tossing = 1;
+			lb->numChars = 0;
+		}
+		if (!lb->tossing) {
+			memcpy(lb->line + lb->numChars, start, len);
+			lb->numChars += len;
+		}
+		start += len;
+		if (nl) {
+		    // make sure to terminate the input in the hope it will stop 
+		    // buffer over-runs
+		    // zero 'nchars' ready for the next time 
+			lb->line[lb->numChars] = '\0';
+			lb->numChars = 0;
+			if (lb->tossing) {
+				lb->tossing = 0;
+			} else {
+				handle(lb->line, arg);
+			}
+		}
+	}
+}
 
-#define DEFAULT_cycleTimeUSec	1000000/50 // default to 50Hz -> 20,000uS
-#define MIN_cycleTimeUSec	655
-#define MAX_cycleTimeUSec	41666
-#define DEFAULT_stepTimeUSec	5 // gives 400 steps for typical servo range
-#define DEFAULT_servoMinPulseUSec	500 // Be aware that many cheap servos get very annoyed
-#define DEFAULT_servoMaxPulseUSec	2500// by getting pushed too far. Use the min/max
-                                    // options to change the limits
+// Everything the main loop waits on. Each is registered with epoll along with a
+// pointer to its endpoint, so a wake-up leads straight to whatever needs serving.
+enum endpoint_kind { EP_TIMER, EP_FIFO, EP_PRIORITY, EP_LISTEN, EP_CLIENT, EP_CONTROL_LISTEN, EP_CONTROL };
+
+struct endpoint {
+	int kind;                   // enum endpoint_kind
+	int fd;                     // -1 while a client slot is free
+	int dead;                   // a control client that couldn't keep up with its replies
+	// text endpoints gather their input into lines, and each has its own
+	// transaction, dropped if a client goes away before committing
+	struct line_buffer lines;
+	struct transaction txn;
+};
+
+static int epollFd;
+static struct endpoint timerEp, fifoEp, priorityEp, listenEp, controlListenEp;
+static struct endpoint clients[MAX_CLIENTS];    // binary socket connections
+static struct endpoint controls[MAX_CLIENTS];   // text control connections
+
+static void fifo_line(char *line, void *arg) {
+	struct endpoint *ep = arg;
+	// A writer that died half way through a transaction would otherwise leave every
+	// later FIFO command held back, so give up on one that has been open too long.
+	if (ep->txn.open && monotonic_nsec() - ep->txn.startNSec > MAX_TXN_MSEC * 1000000ULL) {
+		fprintf(stderr, "Dropping a FIFO transaction left open for over %d ms\n", MAX_TXN_MSEC);
+		end_transaction(&ep->txn, 0);
+	}
+	pca_record(PCA_REC_TEXT, ep->kind == EP_PRIORITY ? PCA_SRC_PRIORITY : PCA_SRC_FIFO,
+		line, strcspn(line, "\r\n"), NULL, 0);
+	currentTxn = &ep->txn;
+	process_command(line);
+	currentTxn = NULL;
+}
 
-#define PCADEVICEFILE			"/dev/pca9685servo"
-#define MAX_SERVOS	16
-#define I2C_BUS 1
-#define DEFAULT_PCA_ADDR 0x40	
-
-// PCA9685 Register & Mode Definitions
-
-#define MODE1 0x00			//Mode  register  1
-#define MODE2 0x01			//Mode  register  2
-#define SUBADR1 0x02		//I2C-bus subaddress 1
-#define SUBADR2 0x03		//I2C-bus subaddress 2
-#define SUBADR3 0x04		//I2C-bus subaddress 3
-#define ALLCALLADR 0x05     //LED All Call I2C-bus address
-#define LED0 0x6			//LED0 start register
-#define LED0_ON_L 0x6		//LED0 output and brightness control byte 0
-#define LED0_ON_H 0x7		//LED0 output and brightness control byte 1
-#define LED0_OFF_L 0x8		//LED0 output and brightness control byte 2
-#define LED0_OFF_H 0x9		//LED0 output and brightness control byte 3
-#define LED_MULTIPLYER 4	// For the other 15 channels
-#define ALLLED_ON_L 0xFA    //load all the LEDn_ON registers, byte 0 (turn 0-7 channels on)
-#define ALLLED_ON_H 0xFB	//load all the LEDn_ON registers, byte 1 (turn 8-15 channels on)
-#define ALLLED_OFF_L 0xFC	//load all the LEDn_OFF registers, byte 0 (turn 0-7 channels off)
-#define ALLLED_OFF_H 0xFD	//load all the LEDn_OFF registers, byte 1 (turn 8-15 channels off)
-#define PRE_SCALE 0xFE		//prescaler for output frequency
-#define CLOCK_FREQ 25000000.0 //25MHz default osc clock
-#define BUFFER_SIZE 0x08  //1 byte buffer
-// MODE1 reg flags
-#define RESTART 0x80
-#define EXTCLK 0x40
-#define AI 0x20
-#define SLEEP 0x10
-#define SUB1 0x8
-#define SUB2 0x4
-#define SUB3 0x2
-#define ALLCALL 0x1
-// MODE2 reg flags
-#define INVRT 0x10
-#define OCH 0x8
-#define OUTDRV 0x4
-#define OUTNE // doesn't matter here
-
-// pigpio values
-static int pi= -1, pca= -1; // the pigpiod handles, initialised to less than 0
-
-// device address
-unsigned int i2c_address;
+// drain whatever is waiting on a FIFO in big gulps, splitting it into lines as we
+// go. The fd is non-blocking so read() stops with EAGAIN once the FIFO is empty; we
+// also stop after MAX_DRAIN_BYTES so a producer that never pauses can't keep the
+// other inputs waiting
+static void drain_fifo(struct endpoint *ep) {
+	static char buf[READ_CHUNK];
+	int n, drained = 0;
+
+	while (drained < MAX_DRAIN_BYTES && (n = read(ep->fd, buf, sizeof(buf))) > 0) {
+		drained += n;
+		feed_lines(&ep->lines, buf, n, fifo_line, ep);
+	}
+}
 
-// cycleTimeUSec is the pulse cycle time per servo, in microseconds.
-// Typically it should be 20ms for a 50Hz frame; it gets adjusted to match the
-// actual value achieved by the PCA9685
-// stepTimeUSec is the pulse width increment granularity, again in microseconds.
+// set up a listening unix socket of the given type
+static int open_socket(const char *path, int type) {
+	struct sockaddr_un addr;
+	int fd;
 
-static double cycleTimeUSec;
-static double stepTimeUSec;
-static uint8_t timer_prescale; // timer setting byte for the PCA9685
+	if (strlen(path) >= sizeof(addr.sun_path))
+		fatal("pca9685servod: Socket path %s is too long\n", path);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, type | SOCK_NONBLOCK, 0)) < 0)
+		fatal("pca9685servod: Failed to create socket: %m\n");
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		fatal("pca9685servod: Failed to bind %s: %m\n", path);
+	if (chmod(path, 0666) < 0)
+		fatal("pca9685servod: Failed to set permissions on %s: %m\n", path);
+	if (listen(fd, MAX_CLIENTS) < 0)
+		fatal("pca9685servod: Failed to listen on %s: %m\n", path);
+	return fd;
+}
 
-static int servoStart[MAX_SERVOS];
-static double servoWidth[MAX_SERVOS];
-static double servoMinPulseUSec, servoMaxPulseUSec;
-#if (DEBUG)
-    unsigned int on_val, off_val;
-#endif
-	
-static void terminate(int dummy)
-{
-    /* disconnect from pigpiod and release the file descriptors */
-	unlink(PCADEVICEFILE);
-	if ( pi >= 0) {
-    	i2c_close(pi, pca);
-    	pigpio_stop(pi);
-    }
-	exit(1);
+// read every message a binary client has sent, acking those that ask for it.
+// Returns -1 once the client has gone away.
+static int service_client(struct endpoint *ep) {
+	static uint8_t buf[PCA_MSG_MAX_SIZE];
+	int fd = ep->fd;
+	struct pca_msg_ack ack;
+	ssize_t len;
+	int n;
+
+	for (n = 0; n < MAX_CLIENT_MESSAGES; n++) {
+		len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC);
+		if (len == 0) return -1;
+		if (len < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		if (len > (ssize_t)sizeof(buf)) {
+			// too big to be any message of ours; process_message will say so
+			len = sizeof(buf) + 1;
+		}
+		if (len <= (ssize_t)sizeof(buf)) {
+			pca_record(PCA_REC_MESSAGE, PCA_SRC_SOCKET, buf, len, NULL, 0);
+		}
+		process_message(buf, len, &ack);
+		if (ack.status != PCA_STATUS_OK) {
+			fprintf(stderr, "Bad message %u from socket client: status %d, item %d\n",
+				ack.seq, ack.status, ack.badItem);
+		}
+		if (len >= (ssize_t)sizeof(struct pca_msg_header) &&
+				(((const struct pca_msg_header *)buf)->flags & PCA_FLAG_ACK)) {
+			// a client that isn't reading its acks just misses them
+			send(fd, &ack, sizeof(ack), MSG_DONTWAIT | MSG_NOSIGNAL);
+		}
+	}
+	return 0;
 }
 
-static void fatal(char *fmt, ...)
-{
+// Connections to the text control socket take the same commands as the FIFO plus a
+// few of their own, and every line gets a reply ending in "ok" or "error".
+static char reply[32768];       // room for a full "?*" on 16 boards
+static int replyLen;
+
+static void reply_printf(const char *fmt, ...) {
 	va_list ap;
+	int n;
 
 	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
+	n = vsnprintf(reply + replyLen, sizeof(reply) - replyLen, fmt, ap);
 	va_end(ap);
-	terminate(0);
+	if (n > 0) replyLen += n;
+	if (replyLen > (int)sizeof(reply) - 1) replyLen = sizeof(reply) - 1;
 }
 
-#if (DEBUG)
-static void read_servo(int servo, unsigned int *on, unsigned int *off) {
-    unsigned int on_off[4];
-    int i, p, ret;
-    // read the pwm parameters for channel servo and return the raw 12 bit unsigned values
-    for (i = LED0_ON_L, p = 0; i <= LED0_OFF_H; i++, p++ ) {
-        ret = i2c_read_byte_data(pi, pca, i + LED_MULTIPLYER * servo);
-        if (ret <0) {
-            DPRINTF(("Bad i2c byte read for servo: %d\n", servo));
-            *on = ret;
-            *off = 0xFFFFFFFF;
-            return;
-        }
-    }
-    *on = on_off[0] | (on_off[1] <<8);
-    *off = on_off[2] | (on_off[3] <<8);
+// send the reply built up so far. A client that lets its socket fill up rather
+// than read its replies gets disconnected; the daemon never waits for one.
+static void reply_send(struct endpoint *client) {
+	if (!client->dead && send(client->fd, reply, replyLen, MSG_DONTWAIT | MSG_NOSIGNAL) != replyLen) {
+		client->dead = 1;
+	}
+	replyLen = 0;
 }
-#endif
 
-static void  all_pwm_off(void)
-{
-    // turn off all pwm outputs
-    i2c_write_byte_data(pi, pca, ALLLED_ON_L, 0);
-    i2c_write_byte_data(pi, pca, ALLLED_ON_H, 0);
-    i2c_write_byte_data(pi, pca, ALLLED_OFF_L, 0);
-    i2c_write_byte_data(pi, pca, ALLLED_OFF_H, 0);
-}
+// the smallest power of two microseconds that covers the given share of samples,
+// or the slowest sample if that is less
+static double hist_percentile(const struct latency_hist *hist, double share) {
+	unsigned long seen = 0;
+	double max = hist->maxNSec / 1000.0;
+	int i;
 
-static void set_servo(int servo, double width)
-{
-    int i, p, ret;
-	servoWidth[servo] = width;
-    int onValue, offValue;
-    unsigned int on_off[4];
-    // set this servo to start at the servoStart tick and stay on for width ticks
-    DPRINTF(( "set servo[%d]=%f %%\n", servo, width * 100.0));
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += hist->count[i];
+		if (seen >= share * hist->samples) return (double)(1UL << i) < max ? (double)(1UL << i) : max;
+	}
+	return max;
+}
 
-    onValue = servoStart[servo];
-    offValue = (onValue 
-                + (int)((
-                (servoWidth[servo] *  (servoMaxPulseUSec - servoMinPulseUSec) + servoMinPulseUSec)) / cycleTimeUSec 
-                * 4096)
-               )  % 4096;
-    DPRINTF(( "pi: %d pca: %d servo: %d on: %d off: %d\n", pi, pca, servo, onValue, offValue));
-    on_off[0] = onValue & 0xFF;   
-    on_off[1] = onValue >> 8;   
-    on_off[2] = offValue & 0xFF;   
-    on_off[3] = offValue >> 8;   
+static void report_hist(const char *name, const struct latency_hist *hist) {
+	int i;
 
-    for (i = LED0_ON_L, p = 0; i <= LED0_OFF_H; i++, p++ ) {
-        ret = i2c_write_byte_data(pi, pca, i + LED_MULTIPLYER * servo, on_off[p]);
-        if (ret < 0) {
-            DPRINTF(("Bad i2c byte[%d] write for servo: %d\n", p, servo));
-            return;
-        }
-    }
+	reply_printf("%s.samples %lu\n", name, hist->samples);
+	if (hist->samples == 0) return;
+	reply_printf("%s.mean_us %.1f\n", name, hist->totalNSec / 1000.0 / hist->samples);
+	reply_printf("%s.p50_us %.0f\n", name, hist_percentile(hist, 0.50));
+	reply_printf("%s.p99_us %.0f\n", name, hist_percentile(hist, 0.99));
+	reply_printf("%s.max_us %.1f\n", name, hist->maxNSec / 1000.0);
+	reply_printf("%s.hist", name);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		reply_printf(" %lu", hist->count[i]);
+	}
+	reply_printf("\n");
+}
 
-#if (DEBUG)
-    read_servo(servo, &on_val, &off_val);
-    DPRINTF(("PCA actually registered on = %u off= %u\n", on_val, off_val));
-    if (off_val == 0xFFFFFFFF) {
-        DPRINTF(("Bad i2c read. errnum = %d\n", on_val));
-    }
-#endif
+// every counter, one "name value" per line
+static void report_stats(void) {
+	struct latency_hist latency, flushTime, jitter;
+	unsigned long updates, writeFailures, boardFailures;
+	struct pca_bus *bus;
+	char name[32];
+	int i, blockWrites;
+
+	reply_printf("commands %lu\n", stats.commands);
+	reply_printf("assignments %lu\n", stats.assignments);
+	reply_printf("messages %lu\n", stats.messages);
+	reply_printf("message_items %lu\n", stats.items);
+	reply_printf("shm_updates %lu\n", stats.shmUpdates);
+	reply_printf("frames %lu\n", stats.frames);
+	reply_printf("frames_missed %lu\n", stats.missedFrames);
+	reply_printf("realtime %d\n", realtimePriority);
+	reply_printf("flight_records %lu\n", pca_flight_count());
+	report_hist("frame.wake", &frameWake);
+	reply_printf("coalesced %lu\n", stats.coalesced);
+	reply_printf("commits %lu\n", stats.commits);
+	reply_printf("aborts %lu\n", stats.aborts);
+	reply_printf("stops %lu\n", stats.stops);
+	reply_printf("discarded %lu\n", stats.discarded);
+	if (recordFile) {
+		reply_printf("record_bytes %lu\n", (unsigned long)pca_record_used());
+		reply_printf("record_dropped %lu\n", pca_record_dropped());
+	}
+	for (i = 0; i < NUM_REJECTS; i++) {
+		reply_printf("rejected.%s %lu\n", rejectNames[i], stats.rejected[i]);
+	}
+	for (i = 0; i < numBuses; i++) {
+		bus = &buses[i];
+		pthread_mutex_lock(&bus->lock);
+		updates = bus->updates;
+		writeFailures = bus->writeFailures;
+		boardFailures = bus->boardFailures;
+		blockWrites = __atomic_load_n(&bus->useBlockWrites, __ATOMIC_RELAXED);
+		latency = bus->latency;
+		flushTime = bus->flushTime;
+		jitter = bus->jitter;
+		pthread_mutex_unlock(&bus->lock);
+		reply_printf("bus%d.backend %s\n", bus->number, bus->i2c.ops->name);
+		reply_printf("bus%d.transactions %lu\n", bus->number, bus->i2c.transactions);
+		reply_printf("bus%d.bytes %lu\n", bus->number, bus->i2c.bytes);
+		reply_printf("bus%d.errors %lu\n", bus->number, bus->i2c.errors);
+		reply_printf("bus%d.updates %lu\n", bus->number, updates);
+		reply_printf("bus%d.write_failures %lu\n", bus->number, writeFailures);
+		reply_printf("bus%d.board_failures %lu\n", bus->number, boardFailures);
+		reply_printf("bus%d.block_writes %d\n", bus->number, blockWrites);
+		snprintf(name, sizeof(name), "bus%d.latency", bus->number);
+		report_hist(name, &latency);
+		snprintf(name, sizeof(name), "bus%d.flush", bus->number);
+		report_hist(name, &flushTime);
+		snprintf(name, sizeof(name), "bus%d.jitter", bus->number);
+		report_hist(name, &jitter);
+	}
 }
 
-static void setup_sighandlers(void)
-{
+// ask each bus worker to read its chips back and wait until they all have. This
+// holds up the main loop for a few i2c reads, which is fine for a diagnostic.
+static void verify_hardware(void) {
+	struct pca_bus *bus;
 	int i;
 
-	// Catch all signals possible
-	for (i = 0; i < 64; i++) {
-		struct sigaction sa;
-
-		memset(&sa, 0, sizeof(sa));
-		sa.sa_handler = terminate;
-		sigaction(i, &sa, NULL);
+	for (i = 0; i < numBuses; i++) {
+		bus = &buses[i];
+		pthread_mutex_lock(&bus->lock);
+		bus->verifyDone = 0;
+		pthread_mutex_unlock(&bus->lock);
+		__atomic_store_n(&bus->verifyRequested, 1, __ATOMIC_RELEASE);
+		kick_worker(bus);
+	}
+	for (i = 0; i < numBuses; i++) {
+		bus = &buses[i];
+		pthread_mutex_lock(&bus->lock);
+		while (!bus->verifyDone) {
+			pthread_cond_wait(&bus->verified, &bus->lock);
+		}
+		pthread_mutex_unlock(&bus->lock);
 	}
 }
 
+// answer a query such as "?3", "?0,4,7 us" or "?* verify" from what the daemon
+// already knows, one line per servo. Units are any of %, us, steps and ticks
+// (the on and off register values), all of them if none are given; verify also
+// reads the chips back and says whether they hold what the daemon thinks.
+static int process_query(char *args) {
+	enum { SHOW_PERCENT = 1, SHOW_USEC = 2, SHOW_STEPS = 4, SHOW_TICKS = 8 };
+	static int wanted[MAX_SERVOS];
+	struct pca_board *board;
+	char *servos, *word, *saveptr, *p;
+	uint8_t on_off[LED_MULTIPLYER];
+	const uint8_t *hw;
+	int servo, show = 0, verify = 0, channel, steps;
+	double width, usec, percent;
+
+	if ((servos = strtok_r(args, " \t", &saveptr)) == NULL) return reject(REJECT_SYNTAX);
+	while ((word = strtok_r(NULL, " \t", &saveptr)) != NULL) {
+		if (!strcmp(word, "%")) show |= SHOW_PERCENT;
+		else if (!strcmp(word, "us")) show |= SHOW_USEC;
+		else if (!strcmp(word, "steps")) show |= SHOW_STEPS;
+		else if (!strcmp(word, "ticks")) show |= SHOW_TICKS;
+		else if (!strcmp(word, "verify")) verify = 1;
+		else return reject(REJECT_SYNTAX);
+	}
+	if (!show) show = SHOW_PERCENT | SHOW_USEC | SHOW_STEPS | SHOW_TICKS;
 
-static void init_servo_starts(int spreadout) {
-    int servo, currentStart = 0;
-	/* set the servo start ticks either at the same time (spreadout = 0) or
-	to spread out the current draw . The former mighth help when driving LEDs */
-	for (servo = 0; servo < MAX_SERVOS; servo++) {
-		servoStart[servo] = currentStart;
-		if (spreadout) currentStart += 4096 / MAX_SERVOS;
+	memset(wanted, 0, sizeof(wanted));
+	if (!strcmp(servos, "*")) {
+		for (servo = 0; servo < numServos; servo++) wanted[servo] = 1;
+	} else {
+		for (word = strtok_r(servos, ",", &saveptr); word; word = strtok_r(NULL, ",", &saveptr)) {
+			if ((*word >= 'a' && *word <= 'z') || (*word >= 'A' && *word <= 'Z')) {
+				struct servo_group *group = find_group(word, strlen(word));
+				if (!group) return reject(REJECT_SERVO);
+				for (servo = 0; servo < numServos; servo++) wanted[servo] |= group->member[servo];
+				continue;
+			}
+			servo = (int)strtol(word, &p, 10);
+			if (p == word || *p) return reject(REJECT_SYNTAX);
+			if (servo < 0 || servo >= numServos) return reject(REJECT_SERVO);
+			wanted[servo] = 1;
+		}
+	}
+	if (verify) verify_hardware();
+
+	for (servo = 0; servo < numServos; servo++) {
+		if (!wanted[servo]) continue;
+		width = (double)servoWidth[servo] / WIDTH_ONE;
+		if (servoCal[servo].led) {
+			// an LED's brightness, time on and ticks
+			steps = (int)lround(width * 4096);
+			percent = led_brightness(steps) / 100.0;
+			usec = width * boards[servo / CHANNELS_PER_BOARD].cycleTimeUSec;
+		} else {
+			percent = width * 100.0;
+			usec = width_to_usec(servo, servoWidth[servo]);
+			steps = (int)lround(usec / stepTimeUSec);
+		}
+		reply_printf("%d", servo);
+		if (show & SHOW_PERCENT) reply_printf(" %.2f%%", percent);
+		if (show & SHOW_USEC) reply_printf(" %.1fus", usec);
+		if (show & SHOW_STEPS) reply_printf(" %d", steps);
+		servo_registers(servo, on_off);
+		if (show & SHOW_TICKS) {
+			reply_printf(" on=%d off=%d", on_off[0] | (on_off[1] << 8), on_off[2] | (on_off[3] << 8));
+		}
+		if (servoCal[servo].led) reply_printf(" led");
+		if (trajectories[servo].active) reply_printf(" moving");
+		if (verify) {
+			board = &boards[servo / CHANNELS_PER_BOARD];
+			channel = servo % CHANNELS_PER_BOARD;
+			hw = &board->verifyRegs[LED_MULTIPLYER * channel];
+			if (board->verifyStatus < 0) {
+				reply_printf(" hw unreadable");
+			} else {
+				// "unsent" means the chip holds what was last sent but the daemon
+				// hasn't sent this position yet (or never has); "mismatch" means
+				// the chip has lost what it was sent
+				reply_printf(" hw on=%d off=%d %s", hw[0] | (hw[1] << 8), hw[2] | (hw[3] << 8),
+					!memcmp(hw, on_off, LED_MULTIPLYER) ? "ok" :
+					!memcmp(hw, &board->verifyShadow[LED_MULTIPLYER * channel], LED_MULTIPLYER) ? "unsent" : "mismatch");
+			}
+		}
+		reply_printf("\n");
 	}
+	return 0;
 }
 
-static void calculateTimerSettings(double cycleTime) {
-    double freq = 1.0e6 / cycleTime;
-	timer_prescale = (CLOCK_FREQ / 4096 / freq)  - 1;
-	DPRINTF(("Setting prescale value to: %d\n", timer_prescale));
-	DPRINTF(("Actual frequency: %8.3f\n", (CLOCK_FREQ / 4096.0) / (timer_prescale + 1)));
-	// adjust the global cycle time to reflect reality
-	cycleTimeUSec = 1e6 * (timer_prescale +1)/ (CLOCK_FREQ / 4096.0);
-	DPRINTF(("Actual cycle time: %8.3fus\n", cycleTimeUSec));
+// A flush only latches together if the backend sends it as one transfer, and then
+// only up to maxMulti writes; otherwise each write changes its outputs at its own
+// STOP. Before a commit is answered, say which buses it could reach in several
+// latches and how many, counting a write per run of neighbouring channels.
+static void report_commit_latch(const struct transaction *txn) {
+	static uint32_t channels[MAX_BOARDS];
+	static int writes[MAX_BOARDS];
+	struct pca_bus *bus;
+	int i, b, run, servo;
+
+	memset(channels, 0, sizeof(channels));
+	memset(writes, 0, sizeof(writes));
+	for (i = 0; i < txn->numTouched; i++) {
+		servo = txn->touched[i];
+		channels[servo / CHANNELS_PER_BOARD] |= 1u << (servo % CHANNELS_PER_BOARD);
+	}
+	for (b = 0; b < numBoards; b++) {
+		bus = boards[b].bus;
+		for (i = 0, run = 0; i <= CHANNELS_PER_BOARD; i++) {
+			if (i < CHANNELS_PER_BOARD && (channels[b] & (1u << i))) {
+				run++;
+			} else if (run) {
+				writes[bus - buses] += (run * LED_MULTIPLYER + bus->i2c.maxBlock - 1) / bus->i2c.maxBlock;
+				run = 0;
+			}
+		}
+	}
+	for (i = 0; i < numBuses; i++) {
+		bus = &buses[i];
+		if (writes[i] > 1 && (!bus->i2c.ops->write_multi || writes[i] > bus->i2c.maxMulti)) {
+			reply_printf("split bus%d %d\n", bus->number, writes[i]);
+		}
+	}
 }
 
-static void setPWMFreq(void) {
- 	uint8_t oldmode, newmode;
- 	int ret;
- 	
- 	ret = i2c_read_byte_data(pi, pca, MODE1);
- 	oldmode = (uint8_t)ret;
-    newmode = (oldmode & ~SLEEP) | SLEEP;    //sleep
-	DPRINTF(("Setting prescale value to: %d\n", timer_prescale));
-    i2c_write_byte_data(pi, pca, MODE1, newmode);        // go to sleep
-    i2c_write_byte_data(pi, pca, PRE_SCALE, timer_prescale);
-    i2c_write_byte_data(pi, pca, MODE1, oldmode);
-    usleep(1000);
-    i2c_write_byte_data(pi, pca, MODE1, oldmode | RESTART);
+static void control_line(char *line, void *arg) {
+	struct endpoint *client = arg;
+	char *end = line + strlen(line);
+
+	while (end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) {
+		*--end = '\0';
+	}
+	while (*line == ' ' || *line == '\t') line++;
+	if (*line == '\0') return;
+	if (!strcmp(line, "stats")) {
+		report_stats();
+		reply_printf("ok\n");
+	} else if (!strcmp(line, "flight")) {
+		int ret = flightFile ? pca_flight_dump(flightFile) : -ENOENT;
+		if (ret < 0) {
+			fprintf(stderr, "Failed to write the flight recorder to %s: %s\n",
+				flightFile ? flightFile : "(nowhere)", strerror(-ret));
+			reply_printf("error\n");
+		} else {
+			reply_printf("flight.records %d\nok\n", ret);
+		}
+	} else if (line[0] == '?') {
+		// settings earlier in this pass, perhaps in the same write, are only
+		// pending; send them now so the answer includes them
+		apply_pending(monotonic_nsec());
+		reply_printf(process_query(line + 1) < 0 ? "error\n" : "ok\n");
+	} else {
+		pca_record(PCA_REC_TEXT, PCA_SRC_CONTROL, line, strlen(line), NULL, 0);
+		if (client->txn.open && is_keyword(line, "commit")) report_commit_latch(&client->txn);
+		currentTxn = &client->txn;
+		reply_printf(process_command(line) < 0 ? "error\n" : "ok\n");
+		currentTxn = NULL;
+	}
+	reply_send(client);
 }
 
-static void init_hardware(void) {
-    uint8_t oldmode;
-    int ret;
-    // connect to the daemon, quit if that fails
-    pi = pigpio_start(NULL, NULL);
-    if (pi < 0)
-	fatal("Unable to connect to pigpiod; is it running?\n");
-    DPRINTF(("pigpio handle = %d\n", pi));
+// read what a control client has sent, up to MAX_DRAIN_BYTES a pass. Returns -1
+// once it has gone away.
+static int service_control(struct endpoint *client) {
+	static char buf[READ_CHUNK];
+	ssize_t n;
+	int drained = 0;
+
+	while (drained < MAX_DRAIN_BYTES && (n = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		drained += n;
+		feed_lines(&client->lines, buf, n, control_line, client);
+		if (client->dead) return -1;
+	}
+	if (n > 0) return 0;            // more to come next pass
+	if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) return -1;
+	return 0;
+}
 
-    // connect to the PCA9685 via i2c, quit if that fails
-    // Consider having the i2c address an argument when starting the daemon?
-    pca = i2c_open(pi, I2C_BUS, i2c_address, 0);
-    if (pca  < 0)
-        fatal("Unable to connect to PCA9685 hardware\n");
-    DPRINTF(("pca handle = %d\n", pca));
-    
-    // initialise the PCA; write config byte to reg 0
-    // See PCA9685.pdf 7.3.1
-    // exactly what is best here is a bit arguable. I see 0x20 or 0x21 or 0 used variously
-    
-    all_pwm_off();
-    ret = i2c_write_byte_data(pi, pca, MODE1, /* AI | */ ALLCALL);
-    DPRINTF(("init_hardware MODE1 set = %d\n", ret));
-    
-    // maybe we should set some flags in MODE2 as well?
-    // 0xC is used in at least one python based driver
-     ret = i2c_write_byte_data(pi, pca, MODE2, /* OCH | */ OUTDRV );
-    DPRINTF(("init_hardware MODE2 set %d\n", ret));
-     // we have to wait for at least 500uS after setting the SLEEP flag to 0
-    usleep(10000);
-    ret = i2c_read_byte_data(pi, pca, MODE1);
-    oldmode = (uint8_t)ret;
-    
-    ret = i2c_write_byte_data(pi, pca, MODE1, (oldmode & ~SLEEP));
-    usleep(10000);
- 
-    setPWMFreq();
+static void discard_line(char *line, void *arg) {
+	struct endpoint *ep = arg;
+	(void)line;
+	stats.discarded++;
+	if (ep->kind == EP_CONTROL) {
+		reply_printf("error\n");
+		reply_send(ep);
+	}
 }
 
-static double parse_width(int servo, char *width_arg) {
-	char *p;
-	char *digits = width_arg;
-	double width;
+// After a stop on the priority lane, throw away what the other inputs had queued
+// up before it, so motion sent ahead of the stop can't undo it. Control clients
+// get an error for each line dropped and binary clients that asked for acks get
+// PCA_STATUS_STOPPED, so neither loses track of its requests.
+static void discard_input(struct endpoint *ep) {
+	static char buf[PCA_MSG_MAX_SIZE > READ_CHUNK ? PCA_MSG_MAX_SIZE : READ_CHUNK];
+	const struct pca_msg_header *hdr = (const struct pca_msg_header *)buf;
+	struct pca_msg_ack ack;
+	ssize_t n;
+	int drained = 0;
+
+	if (ep->kind == EP_CLIENT) {
+		while (drained++ < MAX_DISCARD_MESSAGES
+				&& (n = recv(ep->fd, buf, PCA_MSG_MAX_SIZE, MSG_DONTWAIT)) > 0) {
+			stats.discarded++;
+			if (n < (ssize_t)sizeof(*hdr) || !(hdr->flags & PCA_FLAG_ACK)) continue;
+			memset(&ack, 0, sizeof(ack));
+			ack.magic = PCA_PROTO_MAGIC;
+			ack.version = PCA_PROTO_VERSION;
+			ack.status = PCA_STATUS_STOPPED;
+			ack.seq = hdr->seq;
+			send(ep->fd, &ack, sizeof(ack), MSG_DONTWAIT | MSG_NOSIGNAL);
+		}
+		return;
+	}
+	// a line already part read goes too, along with the rest of it when it comes
+	if (ep->lines.numChars > 0) {
+		ep->lines.numChars = 0;
+		ep->lines.tossing = 1;
+		stats.discarded++;
+	}
+	while (drained < MAX_DRAIN_BYTES && !ep->dead
+			&& (n = read(ep->fd, buf, READ_CHUNK)) > 0) {
+		drained += n;
+		feed_lines(&ep->lines, buf, n, discard_line, ep);
+	}
+}
+
+// drop every transaction left open, for stop and park
+static void abort_transactions(void) {
+	int i;
 
-    // step over any + or - modifier
-	if (*width_arg == '-' || *width_arg == '+') {
-		digits++;
+	if (fifoEp.txn.open) end_transaction(&fifoEp.txn, 0);
+	if (priorityEp.txn.open) end_transaction(&priorityEp.txn, 0);
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (controls[i].fd >= 0 && controls[i].txn.open) end_transaction(&controls[i].txn, 0);
 	}
+}
 
-    // make sure the following string at least starts as a number
-	if (*digits < '0' || *digits > '9') {
-		return -1;
+// start waiting on fd as the given endpoint
+static void watch(struct endpoint *ep, int kind, int fd) {
+	struct epoll_event ev;
+
+	memset(ep, 0, sizeof(*ep));
+	ep->kind = kind;
+	ep->fd = fd;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = ep;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		fatal("pca9685servod: Failed to watch an input: %m\n");
+}
+
+static void unwatch(struct endpoint *ep) {
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, ep->fd, NULL);
+	close(ep->fd);
+	ep->fd = -1;
+	if (ep->txn.open) end_transaction(&ep->txn, 0);
+}
+
+// take a new connection into a free slot of the given table
+static void accept_client(int listenFd, struct endpoint *table, int kind) {
+	int fd = accept(listenFd, NULL, NULL), i;
+
+	if (fd < 0) return;
+	// so that discard_input() can read() it like a FIFO
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	for (i = 0; i < MAX_CLIENTS && table[i].fd >= 0; i++)
+		;
+	if (i == MAX_CLIENTS) {
+		fprintf(stderr, "Too many %s clients; turning one away\n", kind == EP_CLIENT ? "socket" : "control");
+		close(fd);
+		return;
 	}
-	// read the actual float number
-	width = strtod(digits, &p);
-	DPRINTF(( "Raw width input = %f\n", width));
+	watch(&table[i], kind, fd);
+}
 
-	if (*p == '\0') {
-		// Specified in steps
-		DPRINTF(( "steps specified -> %f\n", width));
-        if (*width_arg == '+') {
-            double current = (servoWidth[servo] *  (servoMaxPulseUSec - servoMinPulseUSec) + servoMinPulseUSec) / stepTimeUSec;
-            DPRINTF(( "Add %f to %f = %f\n", width, current, current + width));
-            width = current + width;
-        } else if (*width_arg == '-') {
-            double current = (servoWidth[servo] *  (servoMaxPulseUSec - servoMinPulseUSec) + servoMinPulseUSec) / stepTimeUSec;
-            DPRINTF(( "Subtract %f from %f = %f\n", width, current, current - width));
-            width = current - width;
-        }
-        // convert to fraction
-        width = (width * stepTimeUSec - servoMinPulseUSec) / (servoMaxPulseUSec - servoMinPulseUSec);
-	} else if (!strcmp(p, "us")) {
-	    // Specified in microSeconds
-		DPRINTF(( "time specified -> %fus\n", width));
-        if (*width_arg == '+') {
-            double current = (servoWidth[servo] *  (servoMaxPulseUSec - servoMinPulseUSec) + servoMinPulseUSec);
-            DPRINTF(( "Add %f to %f = %f\n", width, current, current + width));
-            width = current + width;
-        } else if (*width_arg == '-') {
-            double current = (servoWidth[servo] *  (servoMaxPulseUSec - servoMinPulseUSec) + servoMinPulseUSec);
-            DPRINTF(( "Subtract %f from %f = %f\n", width, current, current - width));
-            width = current - width;
-        }
-        // convert to fraction
-        width = (width - servoMinPulseUSec) / (servoMaxPulseUSec - servoMinPulseUSec)	;	
-	} else if (!strcmp(p, "%")) {
-	    // Specified in percentage of total allowed range
-	    width = width / 100.0;
-        if (*width_arg == '+') {
-            double current = servoWidth[servo];
-            DPRINTF(( "Add %f to %f = %f\n", width, current, current + width));
-            width = current + width;
-        } else if (*width_arg == '-') {
-            double current = servoWidth[servo];
-            DPRINTF(( "Subtract %f from %f = %f\n", width, current, current - width));
-            width = current - width;
-        }
-		DPRINTF(( "%% specified -> %f\n", width));
-	} else {
-		return -1;
+// give one input its turn; none of them takes more than a bounded amount per pass
+static void serve(struct endpoint *ep) {
+	uint64_t expirations;
+
+	switch (ep->kind) {
+	case EP_TIMER:
+		// if we fell behind there may be several; one update catches up anyway
+		if (read(ep->fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+			// the updates from this pass belong to the newest of them
+			frameDueNSec = frameNextNSec + (expirations - 1) * framePeriodNSec;
+			frameNextNSec += expirations * framePeriodNSec;
+			hist_add(&frameWake, monotonic_nsec() - frameDueNSec);
+			stats.missedFrames += expirations - 1;
+			stats.frames++;
+			if (shmTable) sample_shm();
+			motion_frame();
+		}
+		break;
+	case EP_FIFO:
+	case EP_PRIORITY:
+		drain_fifo(ep);
+		break;
+	case EP_LISTEN:
+		accept_client(ep->fd, clients, EP_CLIENT);
+		break;
+	case EP_CONTROL_LISTEN:
+		accept_client(ep->fd, controls, EP_CONTROL);
+		break;
+	case EP_CLIENT:
+		if (service_client(ep) < 0) unwatch(ep);
+		break;
+	case EP_CONTROL:
+		if (service_control(ep) < 0) unwatch(ep);
+		break;
 	}
+}
 
-	if (width == 0) {
-		return (int)width;
-	} else if (width < 0.0 || width > 1.0) {
-		return -1;
-	} else {
-		return width;
+// act on a stop or park the last input had in it: one from the priority lane
+// clears out everything queued behind it first, and a park goes out at once
+// rather than waiting for the end of the pass
+static void handle_stop(struct endpoint *from) {
+	int i;
+
+	if (!stopRequested) return;
+	stopRequested = 0;
+	if (from == &priorityEp) {
+		discard_input(&fifoEp);
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			if (clients[i].fd >= 0) discard_input(&clients[i]);
+			if (controls[i].fd >= 0) discard_input(&controls[i]);
+		}
 	}
+	apply_pending(monotonic_nsec());
 }
 
-static void processLoop(void) {
-    // This is the main real loop, where we read any incoming data on PCADEVICEFILE
-    // and parse it for commands.
-	int fd;
-	static char line[1024];
-	int numChars = 0;
+// the priority lane is looked at before anything else in a pass and again after
+// each other input has had its turn, so a stop only ever waits behind one turn
+static void serve_priority(void) {
+	if (priorityEp.fd < 0) return;
+	drain_fifo(&priorityEp);
+	handle_stop(&priorityEp);
+}
 
-	if ((fd = open(PCADEVICEFILE, O_RDWR|O_NONBLOCK)) == -1)
-		fatal("PCA9685servod: Failed to open %s: %m\n", PCADEVICEFILE);
+static void processLoop(void) {
+    // This is the main real loop, where we wait on the FIFOs, the sockets and every
+    // client connection, and parse whatever comes in for commands.
+	struct epoll_event events[2 * MAX_CLIENTS + 6];
+	struct endpoint *ep;
+	uint64_t arrivalNSec;
+	unsigned int rotate = 0;
+	int fd, timerArmed = 0, n, i;
+
+	if ((epollFd = epoll_create1(0)) < 0)
+		fatal("PCA9685servod: Failed to create the event loop: %m\n");
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		clients[i].fd = controls[i].fd = -1;
+	}
+	priorityEp.fd = -1;
+	if ((fd = open(deviceFile, O_RDWR|O_NONBLOCK)) == -1)
+		fatal("PCA9685servod: Failed to open %s: %m\n", deviceFile);
+	watch(&fifoEp, EP_FIFO, fd);
+	if (priorityFile) {
+		if ((fd = open(priorityFile, O_RDWR|O_NONBLOCK)) == -1)
+			fatal("PCA9685servod: Failed to open %s: %m\n", priorityFile);
+		watch(&priorityEp, EP_PRIORITY, fd);
+	}
+	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1)
+		fatal("PCA9685servod: Failed to create the frame timer: %m\n");
+	watch(&timerEp, EP_TIMER, fd);
+	if (socketFile) {
+		watch(&listenEp, EP_LISTEN, open_socket(socketFile, SOCK_SEQPACKET));
+	}
+	if (controlFile) {
+		watch(&controlListenEp, EP_CONTROL_LISTEN, open_socket(controlFile, SOCK_STREAM));
+	}
+	if (shmFile) {
+		open_shm();
+	}
+	arm_frame_timer(timerEp.fd, &timerArmed);
 
 	for (;;) { // endlessly repeat myself endlessly repeating myself...
-		int n, servo;
-		double width;
-		fd_set ifds;
-		char width_arg[100];
-
-        // prepare the file descriptors to read any incoming commands
-		FD_ZERO(&ifds);
-		FD_SET(fd, &ifds);
-
-        // use select to wait on incoming data; skip the rest of the loop if
-        // it returns anything other than 1
-		if ((n = select(fd+1, &ifds, NULL, NULL, NULL)) != 1)
-			continue; 
-		// sit on the file descriptor until something is read or the timeout expires - 
-		// and since we have set no timeout that could be a long time
-		while (read(fd, line+numChars, 1) == 1) {
-		    // read one byte at a time until there is a \n
-		    // and then process what should be a command
-			if (line[numChars] == '\n') {
-			    // make sure to terminate the input in the hope it will stop 
-			    // buffer over-runs
-			    // zero 'nchars' ready for the next time 
-				line[++numChars] = '\0';
-				numChars = 0;
-                n = sscanf(line, "%d=%s", &servo, width_arg);
-                if (n != 2) {
-                    fprintf(stderr, "Bad input: %s", line);
-                } else if (servo < 0 || servo >= MAX_SERVOS) {
-                    fprintf(stderr, "Invalid servo number %d\n", servo);
-                } else if ((width = parse_width(servo, width_arg)) < 0) {
-                    fprintf(stderr, "Invalid width (%f) specified\n", width);
-                } else {
-                    set_servo(servo, width);
-                }
-				
-			} else {
-			    // increment the char count
-			    // if it gets too big, chop it back to 0 as a brutal
-			    // but effective preventative of buffer overrun
-				if (++numChars >= 1022) {
-					fprintf(stderr, "Too much input; tossing out first 1022 chars. Be more careful!\n");
-					numChars = 0;
-				}
-			}
+		if ((n = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), -1)) < 1)
+			continue;
+		arrivalNSec = monotonic_nsec();
+		serve_priority();
+		// Serve everything that is ready round-robin, starting one further along
+		// each pass so nobody is always first. The frame timer keeps its place at
+		// the front so motion stays on the beat.
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &timerEp) serve(&timerEp);
+		}
+		for (i = 0; i < n; i++) {
+			ep = events[(i + rotate) % n].data.ptr;
+			if (ep == &timerEp || ep == &priorityEp || ep->fd < 0) continue;
+			serve(ep);
+			handle_stop(ep);
+			serve_priority();
+		}
+		rotate++;
+		// everything that came in on any input goes out together
+		apply_pending(arrivalNSec);
+		frameDueNSec = 0;
+		arm_frame_timer(timerEp.fd, &timerArmed);
+	}
+}
+
+// parse a list of CPUs such as "3", "2,3" or "1-3"
+static int parse_cpu_list(const char *list, cpu_set_t *cpus) {
+	const char *p = list;
+	char *end;
+	long first, last;
+
+	CPU_ZERO(cpus);
+	for (;;) {
+		first = last = strtol(p, &end, 10);
+		if (end == p || first < 0 || first >= CPU_SETSIZE) return -1;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first || last >= CPU_SETSIZE) return -1;
 		}
+		while (first <= last) CPU_SET(first++, cpus);
+		if (*end == '\0') return 0;
+		if (*end != ',') return -1;
+		p = end + 1;
+	}
+}
+
+// Lock everything mapped now, and everything mapped later, into RAM. The one
+// exception is the recording: it is mostly empty and far too big to hold in
+// memory, so its pages are only brought in as the recording reaches them.
+static void lock_memory(void) {
+	unsigned long start, end;
+	const char *record;
+	size_t recordSize;
+	char line[4096];
+	FILE *f;
+
+	if ((record = pca_record_map(&recordSize)) == NULL) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+			fatal("pca9685servod: Failed to lock memory: %m\n");
+		return;
 	}
+	if (mlockall(MCL_FUTURE) < 0)
+		fatal("pca9685servod: Failed to lock memory: %m\n");
+	if ((f = fopen("/proc/self/maps", "r")) == NULL)
+		fatal("pca9685servod: Failed to read /proc/self/maps: %m\n");
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx", &start, &end) != 2) continue;
+		if (start < (unsigned long)(record + recordSize) && end > (unsigned long)record) continue;
+		// a few, such as [vvar], can't be locked, and don't need to be
+		mlock((void *)start, end - start);
+	}
+	fclose(f);
+}
+
+// --realtime: run under SCHED_FIFO with all our memory locked and faulted in, so
+// neither other processes nor paging can hold up a frame. This has to come after
+// daemon(), as memory locks don't survive its fork, and before the bus workers
+// start so they inherit the policy and the CPUs. The hot path itself only uses
+// static buffers and the stack, which are covered by the lock and the prefault.
+static void setup_realtime(void) {
+	struct sched_param sp;
+
+	if (cpuList && sched_setaffinity(0, sizeof(cpuSet), &cpuSet) < 0)
+		fatal("pca9685servod: Failed to pin to CPUs %s: %m\n", cpuList);
+	if (!realtimePriority) return;
+	// hang on to freed heap memory rather than handing it back to be faulted in
+	// again, and never give an allocation a mapping of its own
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	lock_memory();
+	prefault_stack();
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = realtimePriority;
+	if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0)
+		fatal("pca9685servod: Failed to set SCHED_FIFO priority %d: %m\n", realtimePriority);
+	fprintf(stderr, "Real-time: SCHED_FIFO priority %d, memory locked%s%s\n", realtimePriority,
+		cpuList ? ", CPUs " : "", cpuList ? cpuList : "");
 }
 
 // parse the user-supplied value for the min or max pulse timing; return a value in uS
@@ -457,8 +3054,14 @@ int main(int argc, char **argv) {
 	char *cycleTimeArg = NULL;
 	char *stepTimeArg = NULL;
 	char *i2c_address_arg = NULL;
+	char *boardArgs[MAX_BOARDS];
+	int  numBoardArgs = 0;
+	char *groupArgs[MAX_GROUPS];
+	int  numGroupArgs = 0;
 	char *p;
+	int  i;
 	int  noflicker = 1;
+	int  foreground = 0;
 
 	setvbuf(stdout, NULL, _IOLBF, 0);
 
@@ -474,6 +3077,25 @@ int main(int argc, char **argv) {
 			{ "cycle-time",   required_argument, 0, 'c' },
 			{ "step-size",    required_argument, 0, 's' },
 			{ "i2c-device-address",      required_argument, 0, 'a' },
+			{ "i2c-bus",      required_argument, 0, 'i' },
+			{ "board",        required_argument, 0, 'B' },
+			{ "backend",      required_argument, 0, 'b' },
+			{ "fifo",         required_argument, 0, 'd' },
+			{ "priority",     required_argument, 0, 'P' },
+			{ "socket",       required_argument, 0, 'S' },
+			{ "shm",          required_argument, 0, 'M' },
+			{ "record",       required_argument, 0, 'R' },
+			{ "flight",       required_argument, 0, 'F' },
+			{ "state",        required_argument, 0, 'T' },
+			{ "cold-start",   no_argument,       0, 'O' },
+			{ "calibration",  required_argument, 0, 'C' },
+			{ "control",      required_argument, 0, 'K' },
+			{ "group",        required_argument, 0, 'G' },
+			{ "broadcast",    no_argument,       0, 'A' },
+			{ "realtime",     optional_argument, 0, 'r' },
+			{ "cpu",          required_argument, 0, 'U' },
+			{ "gamma",        required_argument, 0, 'g' },
+			{ "foreground",   no_argument,       0, 'f' },
             { 0,              0,                 0, 0   }
 		};
 
@@ -490,6 +3112,61 @@ int main(int argc, char **argv) {
 			servoMaxPulseArg = optarg;
 		} else if (c == 'a') {
 			i2c_address_arg = optarg;
+		} else if (c == 'i') {
+			i2c_bus = (int)strtol(optarg, &p, 10);
+			if (*optarg < '0' || *optarg > '9' || *p)
+				fatal("Invalid i2c bus number specified\n");
+		} else if (c == 'B') {
+			if (numBoardArgs == MAX_BOARDS)
+				fatal("Too many boards; at most %d are supported\n", MAX_BOARDS);
+			boardArgs[numBoardArgs++] = optarg;
+		} else if (c == 'b') {
+			backendSpec = optarg;
+		} else if (c == 'd') {
+			deviceFile = optarg;
+		} else if (c == 'P') {
+			priorityFile = optarg;
+		} else if (c == 'S') {
+			socketFile = optarg;
+		} else if (c == 'M') {
+			shmFile = optarg;
+		} else if (c == 'R') {
+			recordFile = optarg;
+		} else if (c == 'F') {
+			flightFile = *optarg ? optarg : NULL;
+		} else if (c == 'T') {
+			stateFile = optarg;
+		} else if (c == 'O') {
+			coldStart = 1;
+		} else if (c == 'C') {
+			calibrationFile = optarg;
+		} else if (c == 'G') {
+			if (numGroupArgs == MAX_GROUPS)
+				fatal("Too many groups; at most %d are supported\n", MAX_GROUPS);
+			groupArgs[numGroupArgs++] = optarg;
+		} else if (c == 'A') {
+			broadcastEnabled = 1;
+		} else if (c == 'K') {
+			controlFile = optarg;
+		} else if (c == 'r') {
+			realtimePriority = DEFAULT_RT_PRIORITY;
+			if (optarg) {
+				realtimePriority = (int)strtol(optarg, &p, 10);
+				if (*optarg < '0' || *optarg > '9' || *p
+						|| realtimePriority < sched_get_priority_min(SCHED_FIFO)
+						|| realtimePriority > sched_get_priority_max(SCHED_FIFO))
+					fatal("Invalid real-time priority specified\n");
+			}
+		} else if (c == 'U') {
+			cpuList = optarg;
+			if (parse_cpu_list(cpuList, &cpuSet) < 0)
+				fatal("Invalid CPU list specified\n");
+		} else if (c == 'g') {
+			ledGamma = strtod(optarg, &p);
+			if (p == optarg || *p || ledGamma < 0.1 || ledGamma > 10)
+				fatal("Invalid gamma specified\n");
+		} else if (c == 'f') {
+			foreground = 1;
 		} else if (c== 'n') {
 		    noflicker = 0;
 		} else if (c == 'h') {
@@ -503,6 +3180,52 @@ int main(int argc, char **argv) {
 				"                      default %dus\n"
 				" --i2c-device-address PCA9685 devices can be set to use an i2c address\n"
 				"                      other than the default of %0x\n"
+				"  --i2c-bus=N         the i2c bus the PCA9685 is on, default %d\n"
+				"  --board=BUS:ADDR[:CYCLE]  drive several PCA9685s from one daemon. Give\n"
+				"                      this once per board, in order; board b's outputs are\n"
+				"                      servos b*16 to b*16+15. CYCLE overrides --cycle-time\n"
+				"                      for that board. Each i2c bus is driven by its own\n"
+				"                      thread. Without it there is one board, set by\n"
+				"                      --i2c-bus and --i2c-device-address\n"
+				"  --backend=NAME[:OPTS] how to reach the i2c bus, default %s.\n"
+				"                      'pigpio' goes via the pigpiod daemon, 'i2c-dev' uses\n"
+				"                      /dev/i2c-N directly (add :smbus for SMBus-only\n"
+				"                      adapters) and 'sim' is a simulated PCA9685 for\n"
+				"                      testing without hardware; it takes latency=Nus,\n"
+				"                      clock=NkHz, sleep and keep=FILE options,\n"
+				"                      e.g. --backend=sim:latency=150,clock=400\n"
+				"  --fifo=PATH         the command FIFO to create, default %s\n"
+				"  --priority=PATH     also create a priority FIFO, read ahead of every other\n"
+				"                      input, for stop and park\n"
+				"  --socket=PATH       also listen on a unix socket for the binary protocol\n"
+				"                      in pca9685_proto.h, for clients sending many\n"
+				"                      updates a second\n"
+				"  --shm=PATH          create a shared-memory target table (pca9685_shm.h),\n"
+				"                      e.g. /dev/shm/pca9685servo, sampled every PWM cycle\n"
+				"  --state=FILE        where to keep the servo positions for a warm restart,\n"
+				"                      default %s; --state= keeps none\n"
+				"  --cold-start        reset the boards even if they are still running with\n"
+				"                      the settings the state file says they were given\n"
+				"  --record=FILE       log every command received and register written, with\n"
+				"                      timestamps, for pca9685replay\n"
+				"  --flight=FILE       where a crash leaves the last %d events, default\n"
+				"                      %s; --flight= leaves none\n"
+				"  --group=NAME:SERVOS name a group of servos, e.g. legs:0-5,16-21, which\n"
+				"                      can then be used in place of a servo number\n"
+				"  --broadcast         send identical updates to every board on a bus, or to\n"
+				"                      a group of whole boards, as one write to the ALLCALL\n"
+				"                      or a subaddress. Only use this when the daemon owns\n"
+				"                      every PCA9685 on the bus\n"
+				"  --control=PATH      listen on a unix stream socket for text commands, each\n"
+				"                      answered with ok or error, and 'stats' for counters\n"
+				"  --calibration=FILE  per-servo min, max, trim and invert settings, one servo\n"
+				"                      (or '*') per line in the form of the cal command below\n"
+				"  --realtime[=PRIO]   run under SCHED_FIFO at PRIO, default %d, with all\n"
+				"                      memory locked, for steadier frame timing. Needs root\n"
+				"                      or CAP_SYS_NICE and CAP_IPC_LOCK\n"
+				"  --cpu=LIST          keep the daemon's threads on these CPUs, e.g. 3 or 2-3\n"
+				"  --gamma=G           brightness curve for LED channels, default %.1f\n"
+				"  --foreground        don't detach from the terminal\n"
 				"  --min={N|Nus|N%%}   the minimum allowed pulse width, default %d steps or %dus\n"
 				"  --max={N|Nus|N%%}    the maximum allowed pulse width, default %d steps or %dus\n"
 				"min and max values can be specified in units of steps, in microseconds,\n"
@@ -518,12 +3241,39 @@ int main(int argc, char **argv) {
 				"position by adding a '+' or '-' in front of the width:\n"
 				"  echo 0=+10%% > /dev/pca9685servo\n"
 				"  echo 0=-20 > /dev/pca9685servo\n\n"
+				"Several servos can be set in one go by separating the assignments with\n"
+				"commas, and '*' sets every servo. These are all sent to the PCA9685 together:\n"
+				"  echo 0=50%%,3=1200us,7=+10 > /dev/pca9685servo\n"
+				"  echo '*=50%%' > /dev/pca9685servo\n\n"
+				"Adding '@' and a time in ms (or s) moves the servo there smoothly, one step\n"
+				"per PWM cycle, rather than jumping. The move can be eased with :in, :out or\n"
+				":inout, and a new position for the servo takes over from the move:\n"
+				"  echo 0=80%%@750ms > /dev/pca9685servo\n"
+				"  echo '*=50%%@2s:inout' > /dev/pca9685servo\n\n"
+				"Groups can also be named at runtime and then used like a servo number:\n"
+				"  echo 'group arm 4-7,12' > /dev/pca9685servo\n"
+				"  echo 'arm=50%%@1s' > /dev/pca9685servo\n\n"
+				"A servo's range can be changed at runtime; min, max and trim are in steps\n"
+				"or with 'us' in microseconds, and invert swaps the ends of the range over.\n"
+				"Percentages are positions in the range, while steps and microseconds are\n"
+				"the pulse actually sent, trim and inversion included:\n"
+				"  echo 'cal 3 min=900us max=2100us trim=-10us invert' > /dev/pca9685servo\n\n"
+				"'stop' holds every servo where it is, cancelling moves and anything not yet\n"
+				"sent; 'park' then sends them all to their park position (mid range, or set\n"
+				"with cal park=N), optionally as a timed move such as park@2s:inout\n\n"
+				"'cal N led' makes a channel an LED: a bare number is then 0-4096 PWM ticks\n"
+				"and a percentage a brightness, corrected by --gamma, with 0%% and 100%%\n"
+				"using the chip's full off and full on bits:\n"
+				"  echo 'cal * led' > /dev/pca9685servo\n"
+				"  echo '0=2048,1=25%%' > /dev/pca9685servo\n\n"
 				" --noflicker          set all outputs to start their cycle at the same time\n"
 				"                      which may reduce flicker when driving a number of LEDS\n\n",
 				argv[0],
 				DEFAULT_cycleTimeUSec,
 				DEFAULT_stepTimeUSec,
 				DEFAULT_PCA_ADDR,
+				I2C_BUS, DEFAULT_BACKEND, PCADEVICEFILE, PCASTATEFILE,
+				PCA_FLIGHT_EVENTS, PCAFLIGHTFILE, DEFAULT_RT_PRIORITY, DEFAULT_LED_GAMMA,
 				DEFAULT_servoMinPulseUSec/DEFAULT_stepTimeUSec, DEFAULT_servoMinPulseUSec,
 				DEFAULT_servoMaxPulseUSec/DEFAULT_stepTimeUSec, DEFAULT_servoMaxPulseUSec);
 			exit(0);
@@ -543,11 +3293,7 @@ int main(int argc, char **argv) {
 	}
 
 	if (cycleTimeArg) {
-		cycleTimeUSec = strtol(cycleTimeArg, &p, 10);
-		if (*cycleTimeArg < '0' || *cycleTimeArg > '9' ||
-				(*p && strcmp(p, "us")) ||
-				cycleTimeUSec < MIN_cycleTimeUSec ||
-				cycleTimeUSec > MAX_cycleTimeUSec)
+		if ((cycleTimeUSec = parseCycleTime(cycleTimeArg)) < 0)
 			fatal("Invalid cycle-time specified\n");
 	} else {
 		cycleTimeUSec = DEFAULT_cycleTimeUSec;
@@ -563,11 +3309,21 @@ int main(int argc, char **argv) {
 	} else {
 		stepTimeUSec = DEFAULT_stepTimeUSec;
 	}
+	stepNSec = (int32_t)stepTimeUSec * 1000;
 	
-	calculateTimerSettings(cycleTimeUSec);
+	if (numBoardArgs == 0) {
+		add_board(i2c_bus, i2c_address, cycleTimeUSec);
+	}
+	for (i = 0; i < numBoardArgs; i++) {
+		parseBoardArg(boardArgs[i]);
+	}
+	// min & max given as a percentage are relative to the first board's cycle time
+	cycleTimeUSec = boards[0].cycleTimeUSec;
 
-	if (cycleTimeUSec / stepTimeUSec < 100) {
-		fatal("PCA cycle time must be at least 100 * step-size\n");
+	for (i = 0; i < numBoards; i++) {
+		if (boards[i].cycleTimeUSec / stepTimeUSec < 100) {
+			fatal("PCA cycle time must be at least 100 * step-size\n");
+		}
 	}
 
 	if (servoMinPulseArg) {
@@ -582,8 +3338,10 @@ int main(int argc, char **argv) {
 		servoMaxPulseUSec = DEFAULT_servoMaxPulseUSec;
 	}
 
-	if (servoMaxPulseUSec > cycleTimeUSec) {
-		fatal("max value is larger than cycle time\n");
+	for (i = 0; i < numBoards; i++) {
+		if (servoMaxPulseUSec > boards[i].cycleTimeUSec) {
+			fatal("max value is larger than cycle time\n");
+		}
 	}
 	if (servoMinPulseUSec >= servoMaxPulseUSec) {
 		fatal("min value is >= max value\n");
@@ -592,28 +3350,57 @@ int main(int argc, char **argv) {
 		fatal("min value is too small\n");
 	}
 
-	fprintf(stderr, "Device address = 0x%02x\n", i2c_address);
-	fprintf(stderr, "Requested servo cycle time: %8.3fus\n", cycleTimeUSec);
+	init_calibration();
+	init_gamma();
+	for (i = 0; i < numGroupArgs; i++) {
+		if ((p = strchr(groupArgs[i], ':')) == NULL)
+			fatal("Invalid group %s; use NAME:SERVOS\n", groupArgs[i]);
+		*p++ = '\0';
+		if (define_group(groupArgs[i], p) < 0)
+			fatal("Invalid group %s\n", groupArgs[i]);
+	}
+
+	fprintf(stderr, "i2c backend = %s\n", backendSpec);
+	for (i = 0; i < numBoards; i++) {
+		fprintf(stderr, "Board %d: bus %d, device address = 0x%02x, servos %d-%d, cycle time: %8.3fus\n",
+			i, boards[i].bus->number, boards[i].address,
+			i * CHANNELS_PER_BOARD, (i + 1) * CHANNELS_PER_BOARD - 1, boards[i].cycleTimeUSec);
+	}
 	fprintf(stderr, "Pulse increment step size: %8.3fus\n", stepTimeUSec);
 	fprintf(stderr, "Minimum width value:       %8.3fus (%d)\n", servoMinPulseUSec,
 						(int)(servoMinPulseUSec / stepTimeUSec));
 	fprintf(stderr, "Maximum width value:       %8.3fus (%d)\n", servoMaxPulseUSec,
 						(int)(servoMaxPulseUSec / stepTimeUSec));
+	if (calibrationFile)
+		fprintf(stderr, "Per-servo calibration from %s\n", calibrationFile);
 
 	setup_sighandlers();
 	
 	init_servo_starts(noflicker);
+	assign_subaddresses();
 	init_hardware();
 
-	unlink(PCADEVICEFILE);
-	if (mkfifo(PCADEVICEFILE, 0666) < 0)
-		fatal("pca9685servod: Failed to create %s: %m\n", PCADEVICEFILE);
-	if (chmod(PCADEVICEFILE, 0666) < 0)
-		fatal("pca9685servod: Failed to set permissions on %s: %m\n", PCADEVICEFILE);
+	unlink(deviceFile);
+	if (mkfifo(deviceFile, 0666) < 0)
+		fatal("pca9685servod: Failed to create %s: %m\n", deviceFile);
+	if (chmod(deviceFile, 0666) < 0)
+		fatal("pca9685servod: Failed to set permissions on %s: %m\n", deviceFile);
+	if (priorityFile) {
+		unlink(priorityFile);
+		if (mkfifo(priorityFile, 0666) < 0 || chmod(priorityFile, 0666) < 0)
+			fatal("pca9685servod: Failed to create %s: %m\n", priorityFile);
+	}
 
-	if (daemon(0,1) < 0)
+	if (!foreground && daemon(0,1) < 0)
 		fatal("pca9685servod: Failed to daemonize process: %m\n");
 
+	// memory locks don't survive daemon()'s fork
+	setup_realtime();
+	// and nor do threads, so only start the bus workers now
+	start_workers();
+	// bring any adopted channels whose calibration has changed into line
+	if (numWarmBoards) set_servos(warmChanged, monotonic_nsec());
+
 	processLoop();
 
 	return 0;
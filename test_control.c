@@ -0,0 +1,146 @@
+/* Control socket test for the PCA9685 servo daemon
+ *
+ * Starts the daemon on the simulated bus and checks what the control socket
+ * answers, in particular that a query sees servos set earlier in the same write.
+ * Run it with 'make test-control', or as ./test_control [DAEMON].
+ *
+ * Released under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// one write to the control socket, the lines its answer must contain and how
+// many of the lines sent should be refused
+struct exchange {
+    const char *send;
+    const char *expect[4];
+    int errors;
+};
+
+static const struct exchange exchanges[] = {
+    { "?0,3,7 % us\n", { "0 0.00% 500.0us\n", "3 0.00% 500.0us\n", "7 0.00% 500.0us\n" } },
+    // set and query in one write: the query must answer with the new settings
+    { "0=50%,3=1200us,7=+10\n?0,3,7 % us\n",
+        { "0 50.00% 1500.0us\n", "3 35.00% 1200.0us\n", "7 2.50% 550.0us\n" } },
+    { "5=80%@1s\n?5 %\n", { "5 0.00% moving\n" } },
+    { "7=-4\n?7 us\n", { "7 530.0us\n" } },
+    // the simulated bus sends each write on its own, so a commit across two runs
+    // of channels says it won't latch as one
+    { "begin\n0=10%\n2=10%\ncommit\n", { "split bus1 2\nok\n" } },
+    // a calibration can't be part of a transaction, as it can't wait for the commit
+    { "begin\n1=20%\ncal 1 trim=20us\ncommit\n?1 us\n", { "1 900.0us\n" }, 1 },
+};
+
+static char dir[] = "/tmp/pca9685testXXXXXX";
+static char fifoPath[64], controlPath[64];
+
+static pid_t start_daemon(const char *daemon)
+{
+    char fifoArg[80], controlArg[80];
+    pid_t pid;
+
+    snprintf(fifoArg, sizeof(fifoArg), "--fifo=%s", fifoPath);
+    snprintf(controlArg, sizeof(controlArg), "--control=%s", controlPath);
+    if ((pid = fork()) == 0) {
+        if (!freopen("/dev/null", "w", stderr)) _exit(127);
+        execl(daemon, daemon, "--backend=sim", fifoArg, controlArg, "--state=",
+            "--board=1:0x40", "--foreground", (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+// the daemon takes a moment to make its socket
+static int connect_control(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct timespec pause = { 0, 20000000 };
+    int fd, tries;
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", controlPath);
+    for (tries = 0; tries < 100; tries++) {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) return fd;
+        close(fd);
+        nanosleep(&pause, NULL);
+    }
+    return -1;
+}
+
+// every line sent is answered, ending with "ok" or "error"
+static int run_exchange(int fd, const struct exchange *ex)
+{
+    char reply[4096];
+    const char *p;
+    size_t used = 0;
+    ssize_t n;
+    int lines = 0, answers = 0, errors = 0, i, failed = 0;
+
+    for (p = ex->send; *p; p++) lines += *p == '\n';
+    if (write(fd, ex->send, strlen(ex->send)) != (ssize_t)strlen(ex->send)) return 1;
+    while (answers < lines && used < sizeof(reply) - 1) {
+        if ((n = read(fd, reply + used, sizeof(reply) - 1 - used)) <= 0) break;
+        used += n;
+        reply[used] = '\0';
+        answers = 0;
+        for (p = reply; *p; p += strcspn(p, "\n") + 1) {
+            if (!strncmp(p, "ok\n", 3) || !strncmp(p, "error\n", 6)) answers++;
+            if (!strchr(p, '\n')) break;
+        }
+    }
+    reply[used] = '\0';
+    for (i = 0; i < 4 && ex->expect[i]; i++) {
+        if (!strstr(reply, ex->expect[i])) {
+            printf("FAIL: sent \"%.*s\", wanted \"%.*s\" in:\n%s", (int)strcspn(ex->send, "\n"), ex->send,
+                (int)strcspn(ex->expect[i], "\n"), ex->expect[i], reply);
+            failed = 1;
+        }
+    }
+    for (p = reply; (p = strstr(p, "error\n")) != NULL; p++) errors++;
+    if (errors != ex->errors) {
+        printf("FAIL: sent \"%.*s\", wanted %d errors in:\n%s", (int)strcspn(ex->send, "\n"), ex->send,
+            ex->errors, reply);
+        failed = 1;
+    }
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    const char *daemon = argc > 1 ? argv[1] : "./pca9685servod";
+    int fd, i, failures = 0;
+    pid_t pid;
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(fifoPath, sizeof(fifoPath), "%s/servo", dir);
+    snprintf(controlPath, sizeof(controlPath), "%s/control", dir);
+    pid = start_daemon(daemon);
+    if ((fd = connect_control()) < 0) {
+        printf("FAIL: couldn't connect to %s started from %s\n", controlPath, daemon);
+        failures++;
+    } else {
+        for (i = 0; i < (int)(sizeof(exchanges) / sizeof(exchanges[0])); i++) {
+            failures += run_exchange(fd, &exchanges[i]);
+        }
+        close(fd);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(fifoPath);
+    unlink(controlPath);
+    rmdir(dir);
+    printf("%s: %d of %d exchanges failed\n", failures ? "FAIL" : "PASS", failures,
+        (int)(sizeof(exchanges) / sizeof(exchanges[0])));
+    return failures != 0;
+}